@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "dance.h"
+#include "dance-cells.h"
+#include "sudoku.h"
+
+// Pits DanceMatrix against DanceCells on the same job as a Workspace:
+// one matrix with every candidate of every cell, into which each
+// grid's clues are selected before counting its solutions (up to 2).
+// The grids are the puzzles in gordon-royle.txt, plus a copy of each
+// with one clue changed, which is usually no longer solvable.
+
+template<class Matrix>
+long long count_all(Matrix& mat, const std::vector<std::vector<int>>& grids, std::vector<int>& counts)
+{
+    auto start = std::chrono::steady_clock::now();
+    int constraint[4];
+    for (size_t g = 0; g < grids.size(); ++g) {
+        bool consistent = true;
+        for (int i = 0; i < 81 && consistent; ++i) {
+            int value = grids[g][i];
+            if (value == 0) continue;
+            SudokuShape<3>::get_constraint_columns(i / 9, i % 9, value, constraint);
+            consistent = mat.select_row(4, constraint);
+        }
+        int count = 0;
+        auto f = [&count](int, auto*) {
+            dance_result result;
+            result.count = 1;
+            result.short_circuit = (++count >= 2);
+            return result;
+        };
+        counts[g] = consistent ? mat.template solve<81>(f) : 0;
+        while (mat.num_selected_rows() > 0) {
+            mat.deselect_row();
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = (argc > 1) ? argv[1] : "gordon-royle.txt";
+    FILE *in = fopen(filename, "r");
+    if (in == nullptr) {
+        printf("Can't open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    std::vector<std::vector<int>> grids;
+    char buf[100];
+    while (fgets(buf, sizeof buf, in) != nullptr) {
+        if (strlen(buf) < 81) continue;
+        std::vector<int> grid(81);
+        for (int i=0; i < 81; ++i) {
+            grid[i] = (buf[i] >= '1' && buf[i] <= '9') ? (buf[i] - '0') : 0;
+        }
+        grids.push_back(grid);
+        for (int i=0; i < 81; ++i) {
+            if (grid[i] != 0) {
+                grid[i] = grid[i] % 9 + 1;
+                break;
+            }
+        }
+        grids.push_back(grid);
+    }
+    fclose(in);
+
+    // Both engines get the same matrix as the solvers in sudoku.cc.
+    static DanceMatrix matrix;
+    build_full_sudoku_matrix<3>(matrix);
+    DanceCells cells;
+    build_full_sudoku_matrix<3>(cells);
+
+    std::vector<int> matrix_counts(grids.size());
+    std::vector<int> cells_counts(grids.size());
+    long long matrix_ms = count_all(matrix, grids, matrix_counts);
+    long long cells_ms = count_all(cells, grids, cells_counts);
+
+    int histogram[3] = {};
+    for (size_t g = 0; g < grids.size(); ++g) {
+        if (matrix_counts[g] != cells_counts[g]) {
+            printf("FAILED: the engines disagree on grid %zu\n", g);
+            exit(EXIT_FAILURE);
+        }
+        histogram[matrix_counts[g]] += 1;
+    }
+    printf("%zu grids: %d with no solution, %d with one, %d with several\n",
+           grids.size(), histogram[0], histogram[1], histogram[2]);
+    printf("DanceMatrix: %lld ms\n", matrix_ms);
+    printf("DanceCells:  %lld ms\n", cells_ms);
+    return 0;
+}
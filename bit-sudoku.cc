@@ -0,0 +1,373 @@
+
+#include "bit-sudoku.h"
+
+#include <stdint.h>
+
+// Cell i of the grid is bit i of the 128-bit vector; bits 81..127
+// are always zero. GCC and Clang compile the bitwise operations on
+// this type to single SSE2 (or NEON) instructions.
+typedef uint64_t bits128 __attribute__((vector_size(16)));
+
+static inline bool is_zero(bits128 x) { return (x[0] | x[1]) == 0; }
+
+static inline bool has_one_bit(bits128 x)
+{
+    if (x[0] == 0) return (x[1] != 0) && (x[1] & (x[1] - 1)) == 0;
+    return (x[1] == 0) && (x[0] & (x[0] - 1)) == 0;
+}
+
+static inline int lowest_bit(bits128 x)
+{
+    return (x[0] != 0) ? __builtin_ctzll(x[0]) : 64 + __builtin_ctzll(x[1]);
+}
+
+static inline bool has_bit(bits128 x, int i)
+{
+    return (x[i / 64] >> (i % 64)) & 1;
+}
+
+struct BitboardTables {
+    bits128 all_cells;
+    bits128 cell[81];
+    bits128 peers[81];
+    bits128 unit[27];  // nine rows, nine columns, nine boxes
+
+    BitboardTables() {
+        all_cells = bits128{0, 0};
+        for (int i=0; i < 81; ++i) {
+            cell[i] = bits128{0, 0};
+            cell[i][i / 64] = uint64_t(1) << (i % 64);
+            all_cells |= cell[i];
+        }
+        for (int u=0; u < 27; ++u) {
+            unit[u] = bits128{0, 0};
+        }
+        for (int i=0; i < 81; ++i) {
+            int row = i / 9;
+            int col = i % 9;
+            int box = (row/3)*3 + (col/3);
+            unit[row] |= cell[i];
+            unit[9 + col] |= cell[i];
+            unit[18 + box] |= cell[i];
+        }
+        for (int i=0; i < 81; ++i) {
+            int row = i / 9;
+            int col = i % 9;
+            int box = (row/3)*3 + (col/3);
+            peers[i] = (unit[row] | unit[9 + col] | unit[18 + box]) & ~cell[i];
+        }
+    }
+};
+
+static const BitboardTables tables;
+
+struct BitboardSudoku {
+    bits128 candidates[9];  // candidates[d] has bit i iff digit d+1 may go in cell i
+    bits128 unsolved;
+
+    void init() {
+        for (int d=0; d < 9; ++d) {
+            candidates[d] = tables.all_cells;
+        }
+        unsolved = tables.all_cells;
+    }
+
+    // The caller guarantees that |d| is still a candidate for |i|.
+    void place(int i, int d) {
+        bits128 b = tables.cell[i];
+        for (int e=0; e < 9; ++e) {
+            candidates[e] &= ~b;
+        }
+        candidates[d] = (candidates[d] & ~tables.peers[i]) | b;
+        unsolved &= ~b;
+    }
+
+    bool propagate();
+    int choose_cell() const;
+    void write_grid(int (*grid)[9]) const;
+};
+
+bool BitboardSudoku::propagate()
+{
+    while (true) {
+        bits128 ones = {0, 0};
+        bits128 twos = {0, 0};
+        for (int d=0; d < 9; ++d) {
+            twos |= ones & candidates[d];
+            ones |= candidates[d];
+        }
+        if (!is_zero(tables.all_cells & ~ones)) {
+            return false;  // some cell has no candidates left
+        }
+
+        // Naked singles: unsolved cells with exactly one candidate.
+        bits128 singles = unsolved & ~twos;
+        if (!is_zero(singles)) {
+            do {
+                int i = lowest_bit(singles);
+                singles &= ~tables.cell[i];
+                int d = 0;
+                while (d < 9 && !has_bit(candidates[d], i)) ++d;
+                if (d == 9) return false;  // an earlier single took it
+                place(i, d);
+            } while (!is_zero(singles));
+            continue;
+        }
+
+        // Hidden singles: digits with exactly one place in some unit.
+        bool progress = false;
+        for (int d=0; d < 9; ++d) {
+            for (int u=0; u < 27; ++u) {
+                bits128 x = candidates[d] & tables.unit[u];
+                if (is_zero(x)) return false;
+                if (has_one_bit(x) && !is_zero(x & unsolved)) {
+                    place(lowest_bit(x), d);
+                    progress = true;
+                }
+            }
+        }
+        if (!progress) return true;
+    }
+}
+
+int BitboardSudoku::choose_cell() const
+{
+    // Count candidates per cell in bit-sliced form, saturating at 4,
+    // and prefer a cell with two candidates, then one with three.
+    bits128 ones = {0, 0};
+    bits128 twos = {0, 0};
+    bits128 threes = {0, 0};
+    bits128 fours = {0, 0};
+    for (int d=0; d < 9; ++d) {
+        bits128 c = candidates[d] & unsolved;
+        fours |= threes & c;
+        threes |= twos & c;
+        twos |= ones & c;
+        ones |= c;
+    }
+    bits128 best = twos & ~threes;
+    if (is_zero(best)) best = threes & ~fours;
+    if (is_zero(best)) best = unsolved;
+    return lowest_bit(best);
+}
+
+void BitboardSudoku::write_grid(int (*grid)[9]) const
+{
+    // Meaningful only once every cell is down to one candidate.
+    for (int d=0; d < 9; ++d) {
+        for (bits128 x = candidates[d]; !is_zero(x); x &= ~tables.cell[lowest_bit(x)]) {
+            int i = lowest_bit(x);
+            grid[i/9][i%9] = d+1;
+        }
+    }
+}
+
+// Only the first solution found is stored into |solution|.
+static int count_solutions(const BitboardSudoku& s, int limit, int (*solution)[9])
+{
+    int i = s.choose_cell();
+    int count = 0;
+    for (int d=0; d < 9; ++d) {
+        if (!has_bit(s.candidates[d], i)) continue;
+        BitboardSudoku t = s;
+        t.place(i, d);
+        if (!t.propagate()) continue;
+        if (is_zero(t.unsolved)) {
+            if (count == 0 && solution != nullptr) t.write_grid(solution);
+            count += 1;
+        } else {
+            count += count_solutions(t, limit - count, (count == 0) ? solution : nullptr);
+        }
+        if (count >= limit) break;
+    }
+    return count;
+}
+
+int bitboard_count_sudoku_solutions(const int grid[9][9], int limit, int (*solution)[9])
+{
+    BitboardSudoku s;
+    s.init();
+    for (int i=0; i < 81; ++i) {
+        int value = grid[i/9][i%9];
+        if (value == 0) continue;
+        if (!has_bit(s.candidates[value-1], i)) return 0;
+        s.place(i, value-1);
+    }
+    if (!s.propagate()) return 0;
+    if (is_zero(s.unsolved)) {
+        if (solution != nullptr) s.write_grid(solution);
+        return 1;
+    }
+    return count_solutions(s, limit, solution);
+}
+
+// The lockstep solver gives each puzzle one 16-bit lane; bit d of a
+// cell's lane is set iff digit d+1 may still go in that cell. With
+// -mavx2 (SIMD_FLAGS in the Makefile) each lanes16 operation is a
+// single instruction; otherwise it takes two SSE ones.
+typedef uint16_t lanes16 __attribute__((vector_size(32)));
+static constexpr int lockstep_width = 16;
+
+static inline bool any_lane(const lanes16& x)
+{
+    uint16_t r = 0;
+    for (int k=0; k < lockstep_width; ++k) r |= x[k];
+    return r != 0;
+}
+
+struct LockstepTables {
+    int peers[81][20];
+    int unit[27][9];
+
+    LockstepTables() {
+        for (int i=0; i < 81; ++i) {
+            int row = i / 9;
+            int col = i % 9;
+            int box = (row/3)*3 + (col/3);
+            unit[row][col] = i;
+            unit[9 + col][row] = i;
+            unit[18 + box][(row%3)*3 + (col%3)] = i;
+            int n = 0;
+            for (int j=0; j < 81; ++j) {
+                if (j == i) continue;
+                if (has_bit(tables.peers[i], j)) peers[i][n++] = j;
+            }
+        }
+    }
+};
+
+static const LockstepTables lockstep_tables;
+
+struct LockstepSudoku {
+    lanes16 cell[81];
+    lanes16 eliminated[81];  // the singles already removed from the peers
+    lanes16 dead;  // all-ones in the lanes that have hit a contradiction
+
+    void propagate();
+    bool lane_is_solved(int k) const;
+    void extract_lane(int k, BitboardSudoku& s) const;
+};
+
+void LockstepSudoku::propagate()
+{
+    const lanes16 all_digits = lanes16{} + 0x1FF;
+    const lanes16 zero = lanes16{};
+    while (true) {
+        lanes16 diff = zero;
+
+        // Naked singles: remove each new single's digit from its peers.
+        for (int i=0; i < 81; ++i) {
+            lanes16 c = cell[i];
+            lanes16 s = c & (lanes16)((c & (c - 1)) == zero) & ~eliminated[i];
+            if (!any_lane(s)) continue;
+            eliminated[i] |= s;
+            for (int p : lockstep_tables.peers[i]) {
+                lanes16 old = cell[p];
+                cell[p] = old & ~s;
+                diff |= old ^ cell[p];
+            }
+        }
+
+        // Hidden singles: a digit with one place in a unit goes there.
+        for (int u=0; u < 27; ++u) {
+            lanes16 ones = zero;
+            lanes16 twos = zero;
+            for (int i : lockstep_tables.unit[u]) {
+                twos |= ones & cell[i];
+                ones |= cell[i];
+            }
+            dead |= (lanes16)((ones & all_digits) != all_digits);
+            lanes16 once = ones & ~twos;
+            for (int i : lockstep_tables.unit[u]) {
+                lanes16 h = cell[i] & once;
+                lanes16 has_hidden = (lanes16)(h != zero);
+                dead |= has_hidden & (lanes16)((h & (h - 1)) != zero);
+                lanes16 old = cell[i];
+                cell[i] = (h & has_hidden) | (old & ~has_hidden);
+                diff |= old ^ cell[i];
+            }
+        }
+
+        for (int i=0; i < 81; ++i) {
+            dead |= (lanes16)(cell[i] == zero);
+        }
+        if (!any_lane(diff & ~dead)) return;
+    }
+}
+
+bool LockstepSudoku::lane_is_solved(int k) const
+{
+    for (int i=0; i < 81; ++i) {
+        uint16_t c = cell[i][k];
+        if ((c & (c - 1)) != 0) return false;
+    }
+    return true;
+}
+
+void LockstepSudoku::extract_lane(int k, BitboardSudoku& s) const
+{
+    // propagate() leaves each lane at a fixpoint of the same rules
+    // that BitboardSudoku::propagate() applies, so the singles here
+    // can be taken as solved without further checking.
+    for (int d=0; d < 9; ++d) {
+        s.candidates[d] = bits128{0, 0};
+    }
+    s.unsolved = bits128{0, 0};
+    for (int i=0; i < 81; ++i) {
+        unsigned mask = cell[i][k];
+        uint64_t b = uint64_t(1) << (i % 64);
+        if ((mask & (mask - 1)) != 0) s.unsolved[i / 64] |= b;
+        for ( ; mask != 0; mask &= mask - 1) {
+            s.candidates[__builtin_ctz(mask)][i / 64] |= b;
+        }
+    }
+}
+
+static void lockstep_count(const int (*grids)[9][9], int n, int limit, int *counts,
+                           int (*solutions)[9][9])
+{
+    LockstepSudoku ls;
+    ls.dead = lanes16{};
+    for (int i=0; i < 81; ++i) {
+        ls.eliminated[i] = lanes16{};
+        for (int k=0; k < lockstep_width; ++k) {
+            int value = (k < n) ? grids[k][i/9][i%9] : 0;
+            ls.cell[i][k] = (value != 0) ? (1 << (value-1)) : 0x1FF;
+        }
+    }
+    ls.propagate();
+    for (int k=0; k < n; ++k) {
+        if (ls.dead[k]) {
+            counts[k] = 0;
+        } else if (ls.lane_is_solved(k)) {
+            counts[k] = 1;
+            if (solutions != nullptr) {
+                BitboardSudoku s;
+                ls.extract_lane(k, s);
+                s.write_grid(solutions[k]);
+            }
+        } else {
+            BitboardSudoku s;
+            ls.extract_lane(k, s);
+            counts[k] = count_solutions(s, limit, (solutions != nullptr) ? solutions[k] : nullptr);
+        }
+    }
+}
+
+void bitboard_count_sudoku_solutions_lockstep(const int (*grids)[9][9], int n, int limit, int *counts,
+                                              int (*solutions)[9][9])
+{
+    for (int i=0; i < n; i += lockstep_width) {
+        int m = (n - i < lockstep_width) ? (n - i) : lockstep_width;
+        if (m < lockstep_width / 2) {
+            // Too few puzzles to be worth filling a vector with.
+            for (int k=0; k < m; ++k) {
+                counts[i+k] = bitboard_count_sudoku_solutions(grids[i+k], limit,
+                    (solutions != nullptr) ? solutions[i+k] : nullptr);
+            }
+        } else {
+            lockstep_count(grids + i, m, limit, counts + i,
+                           (solutions != nullptr) ? solutions + i : nullptr);
+        }
+    }
+}
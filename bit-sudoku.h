@@ -0,0 +1,17 @@
+#pragma once
+
+// A specialised 9x9 solver. For each digit it keeps one 128-bit
+// bitboard of the cells where that digit is still possible, and it
+// propagates naked and hidden singles before every guess.
+// Returns the number of solutions, but stops counting at |limit|.
+// If |solution| isn't null, the first solution found is stored there.
+int bitboard_count_sudoku_solutions(const int grid[9][9], int limit, int (*solution)[9] = nullptr);
+
+// Counts the solutions of |n| grids at once, writing each count
+// (capped at |limit|) to |counts|. The grids are propagated in
+// lockstep, sixteen puzzles to a SIMD vector; only the puzzles that
+// propagation can't settle are then searched one at a time.
+// This pays off best when the grids share one clue pattern.
+// If |solutions| isn't null, it receives each grid's first solution.
+void bitboard_count_sudoku_solutions_lockstep(const int (*grids)[9][9], int n, int limit, int *counts,
+                                              int (*solutions)[9][9] = nullptr);
@@ -0,0 +1,111 @@
+
+#include "dance-cells.h"
+
+#include <assert.h>
+
+void DanceCells::init(int ncols)
+{
+    num_items_ = ncols;
+    nrows_ = 0;
+    item_.clear();
+    row_.clear();
+    next_.clear();
+    option_start_.clear();
+    option_end_.clear();
+    selected_.clear();
+    select_marks_.clear();
+    prepared_ = false;
+}
+
+void DanceCells::addrow(int nentries, int *entries)
+{
+    assert(selected_.empty());
+    option_start_.push_back(item_.size());
+    int first = item_.size();
+    for (int i=0; i < nentries; ++i) {
+        item_.push_back(entries[i]);
+        row_.push_back(nrows_);
+        next_.push_back((i+1 < nentries) ? first+i+1 : first);
+    }
+    option_end_.push_back(item_.size());
+    nrows_ += 1;
+    prepared_ = false;
+}
+
+void DanceCells::prepare()
+{
+    if (prepared_) return;
+    int nnodes = item_.size();
+
+    // Lay out each item's block, in the order the options were added,
+    // so that the search tries them in the same order as DanceMatrix.
+    size_.assign(num_items_, 0);
+    for (int x = 0; x < nnodes; ++x) {
+        size_[item_[x]] += 1;
+    }
+    set_start_.resize(num_items_);
+    int start = 0;
+    for (int i = 0; i < num_items_; ++i) {
+        set_start_[i] = start;
+        start += size_[i];
+    }
+    std::vector<int> filled(num_items_, 0);
+    set_.resize(nnodes);
+    loc_.resize(nnodes);
+    for (int x = 0; x < nnodes; ++x) {
+        int i = item_[x];
+        int p = set_start_[i] + filled[i]++;
+        set_[p] = x;
+        loc_[x] = p;
+    }
+
+    num_live_items_ = num_items_;
+    live_items_.resize(num_items_);
+    item_pos_.resize(num_items_);
+    for (int i = 0; i < num_items_; ++i) {
+        live_items_[i] = i;
+        item_pos_[i] = i;
+    }
+    trail_.resize(nnodes);
+    trail_len_ = 0;
+    prepared_ = true;
+}
+
+bool DanceCells::select_row(int nentries, const int *entries)
+{
+    this->prepare();
+    for (int i=0; i < nentries; ++i) {
+        if (item_pos_[entries[i]] >= num_live_items_) return false;
+    }
+    // Find the live option with exactly these items.
+    int first = entries[0];
+    for (int s = 0; s < size_[first]; ++s) {
+        int x = set_[set_start_[first] + s];
+        int o = row_[x];
+        if (option_end_[o] - option_start_[o] != nentries) continue;
+        bool match = true;
+        for (int y = option_start_[o]; y < option_end_[o] && match; ++y) {
+            match = false;
+            for (int i=0; i < nentries; ++i) {
+                if (item_[y] == entries[i]) match = true;
+            }
+        }
+        if (!match) continue;
+
+        select_marks_.push_back(trail_len_);
+        cover(first);
+        cover_rest_of_option(x);
+        selected_.push_back(x);
+        return true;
+    }
+    return false;
+}
+
+void DanceCells::deselect_row()
+{
+    int x = selected_.back();
+    selected_.pop_back();
+    int o = row_[x];
+    uncover(select_marks_.back(), option_end_[o] - option_start_[o]);
+    select_marks_.pop_back();
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <vector>
+#include <stddef.h>
+#include "dance.h"
+
+// An exact-cover solver with the same interface as DanceMatrix, but
+// built on sparse sets (after Knuth's "dancing cells") instead of
+// doubly linked lists. Each item keeps the nodes of its live options
+// in one contiguous block, live ones first; removing a node swaps it
+// past the end of the live part, and undoing that is just growing
+// the live part back. Scanning an item is then a walk along an array
+// rather than a chase down a linked list.
+//
+// As with DanceMatrix, items are columns and options are rows; the
+// rows in a solution are named by node indices, which column_name(),
+// next_in_row() and row_number() understand.
+class DanceCells {
+public:
+    using node_t = int;
+
+    void init(int ncols);
+    void addrow(int nentries, int *entries);
+    // Each item's nodes are laid out together anyway, before a search.
+    void sort_nodes_by_column() {}
+
+    bool select_row(int nentries, const int *entries);
+    void deselect_row();
+    int num_selected_rows() const { return selected_.size(); }
+
+    int column_name(int x) const { return item_[x]; }
+    int next_in_row(int x) const { return next_[x]; }
+    int row_number(int x) const { return row_[x]; }
+
+    template<class F>
+    int solve(const F& f);
+
+    template<class F, class Policy>
+    int solve(const F& f, Policy&& policy)
+    {
+        this->prepare();
+        solution_.resize(num_items_);
+        int k = this->copy_selected_rows(solution_.data());
+        return this->cells_search(k, f, solution_.data(), policy).count;
+    }
+
+    template<int RowsInSolution, class F>
+    int solve(const F& f);
+
+    template<int RowsInSolution, class F, class Policy>
+    int solve(const F& f, Policy&& policy)
+    {
+        this->prepare();
+        node_t solution[RowsInSolution];
+        int k = this->copy_selected_rows(solution);
+        return this->cells_search(k, f, solution, policy).count;
+    }
+
+    // For the column-selection policies. Here a column handle is one
+    // more than the item's place in the list of live items.
+    int first_column() const { return (num_live_items_ > 0) ? 1 : 0; }
+    int next_column(int c) const { return (c < num_live_items_) ? c + 1 : 0; }
+    int column_size(int c) const { return size_[live_items_[c - 1]]; }
+    int column_number(int c) const { return live_items_[c - 1]; }
+
+public:
+    int nrows_ = 0;
+private:
+    int copy_selected_rows(node_t *solution) const {
+        int k = selected_.size();
+        for (int i=0; i < k; ++i) {
+            solution[i] = selected_[i];
+        }
+        return k;
+    }
+
+    // Removes the live options of |item| from every other item, and
+    // then |item| from the live items.
+    void cover(int item)
+    {
+        const int *set = &set_[set_start_[item]];
+        for (int s = 0, n = size_[item]; s < n; ++s) {
+            int x = set[s];
+            for (int y = next_in_row(x); y != x; y = next_in_row(y)) {
+                int other = item_[y];
+                int last = set_start_[other] + size_[other] - 1;
+                int z = set_[last];
+                int p = loc_[y];
+                set_[p] = z;
+                loc_[z] = p;
+                set_[last] = y;
+                loc_[y] = last;
+                size_[other] -= 1;
+                trail_[trail_len_++] = other;
+            }
+        }
+        int p = item_pos_[item];
+        int last = --num_live_items_;
+        int other = live_items_[last];
+        live_items_[p] = other;
+        item_pos_[other] = p;
+        live_items_[last] = item;
+        item_pos_[item] = last;
+    }
+
+    // Covers the items of the option containing |x|, other than
+    // |x|'s own, and returns how many that was.
+    int cover_rest_of_option(int x)
+    {
+        int n = 0;
+        for (int y = next_in_row(x); y != x; y = next_in_row(y)) {
+            cover(item_[y]);
+            n += 1;
+        }
+        return n;
+    }
+
+    // Undoes the last |nitems| covers, which started when the trail
+    // had |mark| entries.
+    void uncover(int mark, int nitems)
+    {
+        num_live_items_ += nitems;
+        while (trail_len_ > mark) {
+            size_[trail_[--trail_len_]] += 1;
+        }
+    }
+
+    void prepare();
+
+    template<class F, class Policy>
+    dance_result cells_search(int k, const F& f, node_t *solution, Policy& policy)
+    {
+        dance_result result = {0, false};
+
+        if (num_live_items_ == 0) {
+            return f(k, (const node_t *)solution);
+        }
+
+        int item = live_items_[policy.choose(*this) - 1];
+        int mark = trail_len_;
+        cover(item);
+
+        // A covered item's own set is left alone until it is
+        // uncovered, so it can be walked directly.
+        const int *set = &set_[set_start_[item]];
+        for (int s = 0, n = size_[item]; s < n; ++s) {
+            int x = set[s];
+            solution[k] = x;
+            int submark = trail_len_;
+            int ncovered = cover_rest_of_option(x);
+            dance_result subresult = this->cells_search(k+1, f, solution, policy);
+            uncover(submark, ncovered);
+            result.count += subresult.count;
+            if (subresult.short_circuit) {
+                result.short_circuit = true;
+                break;
+            }
+        }
+
+        uncover(mark, 1);
+        return result;
+    }
+
+    int num_items_ = 0;
+    int num_live_items_ = 0;
+    std::vector<int> live_items_;  // a permutation of the items, live ones first
+    std::vector<int> item_pos_;  // the inverse permutation
+    std::vector<int> set_start_;  // where each item's block begins in set_
+    std::vector<int> size_;  // how many of each item's options are live
+    std::vector<int> set_;  // the blocks of nodes, one per item
+    std::vector<int> loc_;  // where each node is in set_
+    std::vector<int> item_;  // the item of each node
+    std::vector<int> row_;  // the option of each node
+    std::vector<int> next_;  // the next node of the same option, cyclically
+    std::vector<int> option_start_;  // each option's nodes are contiguous
+    std::vector<int> option_end_;
+    std::vector<int> trail_;  // items whose size to restore, most recent last
+    int trail_len_ = 0;
+    std::vector<int> select_marks_;  // the trail length before each select_row()
+    bool prepared_ = false;  // whether set_ and its friends are up to date
+    std::vector<node_t> selected_;
+    std::vector<node_t> solution_;
+};
+
+template<class F>
+int DanceCells::solve(const F& f)
+{
+    return this->solve(f, MinimumRemainingValues());
+}
+
+template<int RowsInSolution, class F>
+int DanceCells::solve(const F& f)
+{
+    return this->solve<RowsInSolution>(f, MinimumRemainingValues());
+}
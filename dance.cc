@@ -6,65 +6,323 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define USE_HEURISTIC 1
+void DanceStats::add(const DanceStats& rhs)
+{
+    nodes += rhs.nodes;
+    dead_ends += rhs.dead_ends;
+    covers += rhs.covers;
+    updates += rhs.updates;
+    deepest = (rhs.deepest > deepest) ? rhs.deepest : deepest;
+    for (int d=0; d < max_depth; ++d) {
+        for (int b=0; b < max_branching; ++b) {
+            branching[d][b] += rhs.branching[d][b];
+        }
+    }
+}
+
+void DanceStats::print() const
+{
+    printf("%zu search nodes (%zu dead ends), %zu covers, %zu updates, deepest %d\n",
+           nodes, dead_ends, covers, updates, deepest);
+    printf("rows tried per node, by depth:\n");
+    printf("depth");
+    for (int b=0; b < max_branching; ++b) {
+        printf((b == max_branching-1) ? " %9d+" : " %10d", b);
+    }
+    printf("\n");
+    for (int d=0; d < max_depth; ++d) {
+        size_t total = 0;
+        for (int b=0; b < max_branching; ++b) total += branching[d][b];
+        if (total == 0) continue;
+        printf("%5d", d);
+        for (int b=0; b < max_branching; ++b) {
+            printf(" %10zu", branching[d][b]);
+        }
+        printf("\n");
+    }
+}
 
-void *DanceMatrix::Malloc(size_t n)
+void DanceCountCache::clear()
 {
-    n = (n + 7) & ~7;
-    arena_used_ += n;
-    if (arena_used_ <= sizeof memory_arena_) return &memory_arena_[arena_used_ - n];
-    printf("Out of memory in Malloc(%zu)!\n", n);
+    hashes_.assign(hashes_.size(), 0);
+}
+
+void DanceCountCache::prepare(uint64_t rows_id, int ncolumns, int limit)
+{
+    if (rows_id == rows_id_ && ncolumns == ncolumns_ && limit == limit_) return;
+    if (ncolumns == ncolumns_ && !hashes_.empty()) {
+        // Only the counts are stale.
+        rows_id_ = rows_id;
+        limit_ = limit;
+        clear();
+        return;
+    }
+    rows_id_ = rows_id;
+    ncolumns_ = ncolumns;
+    limit_ = limit;
+    nwords_ = (ncolumns + 63) / 64;
+    size_t capacity = size_t(1) << log2_capacity_;
+    hashes_.assign(capacity, 0);
+    counts_.assign(capacity, 0);
+    keys_.assign(capacity * nwords_, 0);
+    // Zobrist hashing: the hash of a set of columns is the xor of
+    // their random codes, so it updates as columns come and go.
+    column_hashes_.resize(ncolumns + 1);
+    uint64_t x = 0x9E3779B97F4A7C15u;
+    for (int c = 0; c <= ncolumns; ++c) {
+        x += 0x9E3779B97F4A7C15u;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+        column_hashes_[c] = z ^ (z >> 31);
+    }
+}
+
+bool DanceCountCache::lookup(uint64_t hash, const uint64_t *key, int *count)
+{
+    hash |= 1;  // so that no real hash looks like an empty slot
+    size_t mask = hashes_.size() - 1;
+    size_t slot = hash & mask;
+    for (int i = 0; i < 2; ++i, slot ^= 1) {
+        if (hashes_[slot] == hash &&
+            memcmp(&keys_[slot * nwords_], key, nwords_ * sizeof (uint64_t)) == 0) {
+            *count = counts_[slot];
+            return true;
+        }
+    }
+    return false;
+}
+
+void DanceCountCache::insert(uint64_t hash, const uint64_t *key, int count)
+{
+    hash |= 1;
+    size_t mask = hashes_.size() - 1;
+    size_t slot = hash & mask;
+    if (hashes_[slot] != 0 && hashes_[slot ^ 1] == 0) {
+        slot ^= 1;
+    }
+    hashes_[slot] = hash;
+    counts_[slot] = count;
+    memcpy(&keys_[slot * nwords_], key, nwords_ * sizeof (uint64_t));
+}
+
+template<class Storage>
+BasicDanceMatrix<Storage>& BasicDanceMatrix<Storage>::operator=(const BasicDanceMatrix& rhs)
+{
+    if (this == &rhs) return *this;
+    // Copy only the nodes in use, so that snapshotting a small
+    // matrix costs a few KB rather than the whole capacity.
+    nrows_ = rhs.nrows_;
+    ncolumns_ = rhs.ncolumns_;
+    nnodes_ = rhs.nnodes_;
+    rows_id_ = rhs.rows_id_;
+    selected_ = rhs.selected_;
+    up_.copy_prefix(rhs.up_, nnodes_);
+    down_.copy_prefix(rhs.down_, nnodes_);
+    left_.copy_prefix(rhs.left_, nnodes_);
+    right_.copy_prefix(rhs.right_, nnodes_);
+    col_.copy_prefix(rhs.col_, nnodes_);
+    row_.copy_prefix(rhs.row_, nnodes_);
+    return *this;
+}
+
+// Shared by every kind of matrix, since any of them may use a cache.
+static std::atomic<uint64_t> last_rows_id{0};
+
+template<class Storage>
+uint64_t BasicDanceMatrix<Storage>::new_rows_id()
+{
+    return ++last_rows_id;
+}
+
+template<class Storage>
+int BasicDanceMatrix<Storage>::new_node()
+{
+    int n = nnodes_ + 1;
+    if (nnodes_ < max_nodes && up_.reserve(n) && down_.reserve(n) &&
+        left_.reserve(n) && right_.reserve(n) && col_.reserve(n) && row_.reserve(n)) {
+        return nnodes_++;
+    }
+    printf("Out of memory in new_node() with %d nodes!\n", nnodes_);
     exit(EXIT_FAILURE);
 }
 
-void DanceMatrix::init(int cols)
+template<class Storage>
+void BasicDanceMatrix<Storage>::init(int cols)
 {
-    arena_used_ = 0;
+    nnodes_ = 0;
+    nrows_ = 0;
     ncolumns_ = cols;
-    columns_ = (struct column_object *)Malloc(ncolumns_ * sizeof *columns_);
-    head_.right = &columns_[0];
-    head_.left = &columns_[ncolumns_-1];
-
-    for (int i=0; i < ncolumns_; ++i) {
-        columns_[i].name = i;
-        columns_[i].size = 0;
-        columns_[i].up = &columns_[i];
-        columns_[i].down = &columns_[i];
-        if (i > 0) {
-            columns_[i].left = &columns_[i-1];
+    rows_id_ = new_rows_id();
+    selected_.clear();
+    for (int i=0; i <= ncolumns_; ++i) {
+        int c = new_node();
+        col_[c] = 0;
+        up_[c] = c;
+        down_[c] = c;
+        left_[c] = (c == 0) ? ncolumns_ : c-1;
+        right_[c] = (c == ncolumns_) ? 0 : c+1;
+    }
+}
+
+template<class Storage>
+void BasicDanceMatrix<Storage>::addrow(int nentries, int *entries)
+{
+    int h = -1;
+
+    for (int i=0; i < nentries; ++i) {
+        int o = new_node();
+        int c = entries[i] + 1;
+        col_[o] = c;
+        row_[o] = nrows_;
+        col_[c] += 1;
+        down_[o] = c;
+        up_[o] = up_[c];
+        up_[down_[o]] = o;
+        down_[up_[o]] = o;
+        if (h != -1) {
+            left_[o] = left_[h];
+            right_[o] = h;
+            right_[left_[o]] = o;
+            left_[right_[o]] = o;
         } else {
-            columns_[i].left = &head_;
+            left_[o] = o;
+            right_[o] = o;
+            h = o;
         }
-        if (i < cols-1) {
-            columns_[i].right = &columns_[i+1];
-        } else {
-            columns_[i].right = &head_;
+    }
+    nrows_ += 1;
+    rows_id_ = new_rows_id();
+}
+
+template<class Storage>
+void BasicDanceMatrix<Storage>::sort_nodes_by_column()
+{
+    // Renumber the data nodes so that each column's nodes are
+    // contiguous and in top-to-bottom order. This must be done
+    // while no columns are covered.
+    std::vector<node_t> renumber(nnodes_);
+    std::vector<node_t> old_left(nnodes_);
+    std::vector<node_t> old_right(nnodes_);
+    std::vector<node_t> old_row(nnodes_);
+    for (int i = 0; i < nnodes_; ++i) {
+        old_left[i] = left_[i];
+        old_right[i] = right_[i];
+        old_row[i] = row_[i];
+    }
+    for (int c = 0; c <= ncolumns_; ++c) {
+        renumber[c] = c;
+    }
+    int next = ncolumns_ + 1;
+    for (int c = 1; c <= ncolumns_; ++c) {
+        for (int i = down_[c]; i != c; i = down_[i]) {
+            renumber[i] = next++;
         }
     }
+    next = ncolumns_ + 1;
+    for (int c = 1; c <= ncolumns_; ++c) {
+        int first = next;
+        next += col_[c];
+        for (int i = first; i < next; ++i) {
+            col_[i] = c;
+            up_[i] = (i == first) ? c : i-1;
+            down_[i] = (i == next-1) ? c : i+1;
+        }
+        up_[c] = (first == next) ? c : next-1;
+        down_[c] = (first == next) ? c : first;
+    }
+    for (int i = ncolumns_ + 1; i < nnodes_; ++i) {
+        left_[renumber[i]] = renumber[old_left[i]];
+        right_[renumber[i]] = renumber[old_right[i]];
+        row_[renumber[i]] = old_row[i];
+    }
 }
 
-void DanceMatrix::addrow(int nentries, int *entries)
+template<class Storage>
+bool BasicDanceMatrix<Storage>::row_has_entries(int r, int nentries, const int *entries) const
 {
-    struct data_object *h = nullptr;
+    int n = 0;
+    int x = r;
+    do {
+        bool found = false;
+        for (int i=0; i < nentries; ++i) {
+            if (int(col_[x]) == entries[i] + 1) found = true;
+        }
+        if (!found) return false;
+        n += 1;
+        x = right_[x];
+    } while (x != r);
+    return (n == nentries);
+}
 
-    struct data_object *news = (struct data_object *)Malloc(nentries * sizeof *news);
+template<class Storage>
+bool BasicDanceMatrix<Storage>::select_row(int nentries, const int *entries)
+{
+    // A row is still available exactly when none of its columns
+    // has been covered.
     for (int i=0; i < nentries; ++i) {
-        struct data_object *o = &news[i];
-        o->column = &columns_[entries[i]];
-        o->column->size += 1;
-        o->down = &columns_[entries[i]];
-        o->up = o->down->up;
-        o->down->up = o;
-        o->up->down = o;
-        if (h != nullptr) {
-            o->left = h->left;
-            o->right = h;
-            o->left->right = o;
-            o->right->left = o;
-        } else {
-            o->left = o;
-            o->right = o;
-            h = o;
+        if (is_covered(entries[i] + 1)) return false;
+    }
+    int c = entries[0] + 1;
+    for (int r = down_[c]; r != c; r = down_[r]) {
+        if (row_has_entries(r, nentries, entries)) {
+            select_node(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+template<class Storage>
+void BasicDanceMatrix<Storage>::select_node(int r)
+{
+    dancing_cover(col_[r]);
+    for (int j = right_[r]; j != r; j = right_[j]) {
+        dancing_cover(col_[j]);
+    }
+    selected_.push_back(r);
+}
+
+template<class Storage>
+void BasicDanceMatrix<Storage>::deselect_row()
+{
+    int r = selected_.back();
+    selected_.pop_back();
+    for (int j = left_[r]; j != r; j = left_[j]) {
+        dancing_uncover(col_[j]);
+    }
+    dancing_uncover(col_[r]);
+}
+
+template<class Storage>
+void BasicDanceMatrix<Storage>::split_search(int depth, std::vector<node_t>& path,
+                                            std::vector<std::vector<node_t>>& subproblems)
+{
+    // Walk the top |depth| levels of the search tree, branching as
+    // MinimumRemainingValues would, and record the rows chosen on the
+    // way to each frontier node. Any branching rule partitions the
+    // solutions, so the workers are free to use a different policy.
+    // Branches that die before the frontier are simply dropped.
+    if (depth == 0 || right_[0] == 0) {
+        subproblems.push_back(path);
+        return;
+    }
+    int c = MinimumRemainingValues().choose(*this);
+    dancing_cover(c);
+    for (int r = down_[c]; r != c; r = down_[r]) {
+        path.push_back(r);
+        for (int j = right_[r]; j != r; j = right_[j]) {
+            dancing_cover(col_[j]);
         }
+        split_search(depth - 1, path, subproblems);
+        for (int j = left_[r]; j != r; j = left_[j]) {
+            dancing_uncover(col_[j]);
+        }
+        path.pop_back();
     }
+    dancing_uncover(c);
 }
+
+template class BasicDanceMatrix<FixedDanceStorage<4096>>;
+template class BasicDanceMatrix<GrowableDanceStorage<>>;
+template class BasicDanceMatrix<GrowableDanceStorage<uint16_t>>;
@@ -1,155 +1,776 @@
 #pragma once
 
+#include <atomic>
+#include <thread>
 #include <type_traits>
+#include <vector>
+#include <limits>
+#include <assert.h>
 #include <limits.h>
-
-extern char dance_memory_arena[];
-
-#if 0
-template<class T>
-class DancePtr {
-    T *ptr_;
-public:
-    constexpr DancePtr() noexcept = default;
-    constexpr DancePtr(T *p) noexcept : ptr_(p) {}
-    constexpr T *get() const noexcept { return ptr_; }
-    constexpr operator T*() const noexcept { return get(); }
-    constexpr T* operator->() const noexcept { return get(); }
-    constexpr T& operator*() const noexcept { return *get(); }
-};
-#else
-template<class T>
-using DancePtr = T*;
-#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 struct dance_result {
     int count;
     int short_circuit;
 };
 
-struct column_object;
+// Every node of a dance matrix is named by an index into the parallel
+// arrays up_, down_, left_, right_, col_. Node 0 is the root; nodes
+// 1..ncolumns are the column headers; the data nodes follow. Where
+// those arrays live is up to the Storage parameter of BasicDanceMatrix.
 
-struct data_object {
-    DancePtr<data_object> up, down, left, right;
-    DancePtr<column_object> column;
-    template<class T> T& as() { return *(T*)this; }
+template<class T, int N>
+struct FixedDanceArray {
+    T data_[N];
+    T& operator[](int i) { return data_[i]; }
+    const T& operator[](int i) const { return data_[i]; }
+    bool reserve(int n) { return n <= N; }
+    void copy_prefix(const FixedDanceArray& rhs, int n) {
+        memcpy(data_, rhs.data_, n * sizeof (T));
+    }
 };
 
-struct column_object : public data_object {
-    int size;
-    int name;
+template<class T, int ChunkSize>
+struct GrowableDanceArray {
+    std::vector<T> data_;
+    T& operator[](int i) { return data_[i]; }
+    const T& operator[](int i) const { return data_[i]; }
+    bool reserve(int n) {
+        if (n > (int)data_.size()) {
+            data_.resize((n + ChunkSize - 1) / ChunkSize * ChunkSize);
+        }
+        return true;
+    }
+    void copy_prefix(const GrowableDanceArray& rhs, int n) {
+        data_.assign(rhs.data_.begin(), rhs.data_.begin() + n);
+    }
+};
+
+// Room for MaxNodes nodes, held inline. Running out is fatal, but a
+// small matrix needs no heap traffic at all.
+template<int MaxNodes>
+struct FixedDanceStorage {
+    using node_t = typename std::conditional<(MaxNodes <= 65536), uint16_t, uint32_t>::type;
+    template<class T> using array = FixedDanceArray<T, MaxNodes>;
+    static constexpr int max_nodes = MaxNodes;
+};
+
+// Room that grows ChunkNodes nodes at a time, up to whatever Node
+// can index. For matrices whose size isn't known in advance.
+template<class Node = uint32_t, int ChunkNodes = 4096>
+struct GrowableDanceStorage {
+    using node_t = Node;
+    template<class T> using array = GrowableDanceArray<T, ChunkNodes>;
+    static constexpr int max_nodes =
+        (sizeof (Node) < sizeof (int)) ? int(std::numeric_limits<Node>::max()) + 1 : INT_MAX;
+};
+
+// Build with -DDANCE_STATS=1 to have every search (solve() and its
+// variants, resume_search(), count_solutions() and
+// count_solutions_by_rows()) record the shape of its search tree in
+// the DanceStats given to set_stats(). Otherwise the bookkeeping is
+// compiled out.
+#ifndef DANCE_STATS
+#define DANCE_STATS 0
+#endif
+
+struct DanceStats {
+    static constexpr int max_depth = 96;  // deeper nodes count as this deep
+    static constexpr int max_branching = 10;  // and wider ones as this wide
+
+    size_t nodes = 0;
+    size_t dead_ends = 0;  // nodes whose chosen column was empty
+    size_t covers = 0;  // each undone by an uncover
+    size_t updates = 0;  // links removed by those covers
+    int deepest = 0;
+    // branching[d][b] counts the nodes at depth d that tried b rows.
+    size_t branching[max_depth][max_branching] = {};
+
+    void add(const DanceStats& rhs);
+    void print() const;
 };
 
-class DanceMatrix {
+// A bounded memo for BasicDanceMatrix::count_solutions(), mapping
+// each set of uncovered columns to its number of solutions (capped
+// at the limit). Which rows remain depends only on which columns are
+// uncovered, so the memo stays good across solves of one matrix, with
+// any rows selected, as long as the matrix's rows never change; it
+// clears itself when used with any other rows. It's a plain hash
+// table with two slots per bucket, which overwrites on collision
+// rather than growing. Each slot takes 12 bytes, plus 8 for every 64
+// columns.
+class DanceCountCache {
 public:
-    explicit DanceMatrix() = default;
+    explicit DanceCountCache(int log2_capacity = 16) : log2_capacity_(log2_capacity) {}
+
+    void clear();
+
+    size_t hits = 0;
+    size_t misses = 0;
+
+private:
+    template<class Storage> friend class BasicDanceMatrix;
+
+    // Matches the cache to a matrix's rows (see
+    // BasicDanceMatrix::rows_id_) and columns, and to a limit; a
+    // mismatch with the previous use clears the cache.
+    void prepare(uint64_t rows_id, int ncolumns, int limit);
+    uint64_t column_hash(int c) const { return column_hashes_[c]; }
+    bool lookup(uint64_t hash, const uint64_t *key, int *count);
+    void insert(uint64_t hash, const uint64_t *key, int count);
+
+    int log2_capacity_;
+    uint64_t rows_id_ = 0;
+    int ncolumns_ = -1;
+    int limit_ = 0;
+    int nwords_ = 0;
+    std::vector<uint64_t> column_hashes_;
+    std::vector<uint64_t> hashes_;  // zero for an empty slot
+    std::vector<int> counts_;
+    std::vector<uint64_t> keys_;  // nwords_ per slot
+};
+
+struct MinimumRemainingValues;
+
+template<class Storage>
+class BasicDanceMatrix {
+public:
+    using node_t = typename Storage::node_t;
+    static constexpr int max_nodes = Storage::max_nodes;
+    static_assert(max_nodes - 1 <= std::numeric_limits<node_t>::max(),
+                  "node indices must fit in node_t");
+
+    explicit BasicDanceMatrix() = default;
+    BasicDanceMatrix(const BasicDanceMatrix& rhs) { *this = rhs; }
+    BasicDanceMatrix& operator=(const BasicDanceMatrix& rhs);
+
     void init(int ncols);
     void addrow(int nentries, int *entries);
+    void sort_nodes_by_column();
+
+    // Commit to the row with exactly these entries, covering all of its
+    // columns, so that every subsequent solve() includes it. Returns
+    // false (and changes nothing) if the row is no longer available
+    // because it conflicts with a row selected earlier.
+    bool select_row(int nentries, const int *entries);
+    // Undo the most recent successful select_row().
+    void deselect_row();
+    int num_selected_rows() const { return selected_.size(); }
+
+    int column_name(int x) const { return col_[x] - 1; }
+    int next_in_row(int x) const { return right_[x]; }
+    // Rows are numbered from 0 in the order they were added.
+    int row_number(int x) const { return row_[x]; }
 
+    // The search branches on the column chosen by |policy|; see the
+    // column-selection policies below. By default, that's the column
+    // with the fewest rows.
     template<class F>
-    int solve(const F& f)
+    int solve(const F& f);
+
+    template<class F, class Policy>
+    int solve(const F& f, Policy&& policy)
     {
-        data_object **solution = (struct data_object **)Malloc(ncolumns_ * sizeof *solution);
-        dance_result result = this->dancing_search(0, f, solution);
+        // The buffers are kept for the next call; no solution can have
+        // more rows than the matrix has columns.
+        solution_.resize(ncolumns_);
+        columns_.resize(ncolumns_);
+        dance_result result = this->dancing_search(f, solution_.data(), columns_.data(), policy);
         return result.count;
     }
 
     template<int RowsInSolution, class F>
-    int solve(const F& f)
+    int solve(const F& f);
+
+    template<int RowsInSolution, class F, class Policy>
+    int solve(const F& f, Policy&& policy)
     {
-        data_object *solution[RowsInSolution];
-        dance_result result = this->dancing_search(0, f, solution);
+        node_t solution[RowsInSolution];
+        node_t columns[RowsInSolution];
+        dance_result result = this->dancing_search(f, solution, columns, policy);
         return result.count;
     }
 
-private:
-    void *Malloc(size_t n);
+    // A solve() that can be done a bit at a time. begin_search()
+    // starts it; each resume_search() then runs it for up to
+    // |max_nodes| more search nodes, and returns true once the search
+    // is over, after which search_count() is what solve() would have
+    // returned. Until then the matrix is in the middle of the search,
+    // and must not be used for anything else, unless the search is
+    // first given up with abandon_search(). Between calls, the policy
+    // may be copied or replaced, and f may change.
+    void begin_search()
+    {
+        solution_.resize(ncolumns_);
+        columns_.resize(ncolumns_);
+        search_.base = this->copy_selected_rows(solution_.data());
+        search_.k = search_.base;
+        search_.entering = true;
+        search_.result = {0, false};
+    }
+
+    template<class F, class Policy>
+    bool resume_search(const F& f, Policy&& policy, size_t max_nodes)
+    {
+        return this->dancing_search(search_, f, solution_.data(), columns_.data(), policy, max_nodes);
+    }
+
+    void abandon_search()
+    {
+        this->unwind_search(search_, solution_.data(), columns_.data());
+    }
+
+    int search_count() const { return search_.result.count; }
+
+    // Returns what solve() would with a callback that stops at |limit|
+    // solutions, but looks up and records the count of each subproblem
+    // in |cache|. Each subproblem is counted up to the full limit, so
+    // that its count can be reused anywhere.
+    template<class Policy>
+    int count_solutions(int limit, DanceCountCache& cache, Policy&& policy)
+    {
+        cache.prepare(rows_id_, ncolumns_, limit);
+        std::vector<uint64_t>& key = count_key_;
+        key.assign(cache.nwords_, 0);
+        uint64_t hash = 0;
+        for (int c = right_[0]; c != 0; c = right_[c]) {
+            key[(c-1) / 64] |= uint64_t(1) << ((c-1) % 64);
+            hash ^= cache.column_hash(c);
+        }
+        return this->counting_search(num_selected_rows(), limit, cache, key.data(), hash, policy);
+    }
+
+    int count_solutions(int limit, DanceCountCache& cache);
+
+    // Counts solutions grouped by the rows they use to cover the |n|
+    // uncovered columns |columns|. The search covers those columns
+    // first, in order, and then counts each choice of their rows up
+    // to |cap| solutions. On the way, accept(i, rows) says whether
+    // any choice beginning with the row numbers rows[0..i] is wanted,
+    // and f(rows, count) hears the count of each one that is; it
+    // returns true to stop. Returns the sum of the counts.
+    template<class Accept, class F, class Policy>
+    int count_solutions_by_rows(int n, const int *columns, int cap, const Accept& accept, const F& f,
+                                Policy&& policy)
+    {
+        solution_.resize(ncolumns_);
+        columns_.resize(ncolumns_);
+        group_rows_.resize(n);
+        return this->grouping_search(0, n, columns, group_rows_.data(), cap, accept, f, policy).count;
+    }
+
+    // Until set_stats(nullptr), each search adds to |*stats|.
+    void set_stats(DanceStats *stats) { stats_ = stats; }
+
+    // For the column-selection policies, which walk the uncovered
+    // columns as: for (int c = first_column(); c != 0; c = next_column(c))
+    int first_column() const { return right_[0]; }
+    int next_column(int c) const { return right_[c]; }
+    int column_size(int c) const { return col_[c]; }
+    int column_number(int c) const { return c - 1; }  // as passed to addrow
 
+    // Like solve(), but splits the first |split_depth| levels of the
+    // search tree into independent subproblems and shares them out
+    // among |nthreads| threads, each with its own copy of the matrix.
+    // |f| may be called concurrently from several threads. As soon as
+    // any call returns short_circuit, every thread stops searching;
+    // the returned count may then overshoot what a solve() would return.
     template<class F>
-    dance_result dancing_search(int k, const F& f, struct data_object **solution)
+    int solve_in_parallel(const F& f, int nthreads, int split_depth = 3);
+
+    template<class F, class Policy>
+    int solve_in_parallel(const F& f, int nthreads, int split_depth, const Policy& prototype)
     {
-        dance_result result = {0, false};
+        std::vector<std::vector<node_t>> subproblems;
+        std::vector<node_t> path;
+        this->split_search(split_depth, path, subproblems);
+
+        std::atomic<int> next_subproblem{0};
+        std::atomic<int> total{0};
+        std::atomic<bool> stop{false};
+        auto worker = [&]() {
+            Policy policy = prototype;
+            BasicDanceMatrix mat = *this;
+            mat.interrupt_ = &stop;
+            std::vector<node_t> solution(ncolumns_);
+            std::vector<node_t> columns(ncolumns_);
+            for (int i; (i = next_subproblem++) < (int)subproblems.size(); ) {
+                if (stop) break;
+                for (int r : subproblems[i]) {
+                    mat.select_node(r);
+                }
+                dance_result result = mat.dancing_search(f, solution.data(), columns.data(), policy);
+                total += result.count;
+                if (result.short_circuit) {
+                    stop = true;
+                }
+                for (size_t j=0; j < subproblems[i].size(); ++j) {
+                    mat.deselect_row();
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int t=1; t < nthreads; ++t) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& t : threads) {
+            t.join();
+        }
+        return total;
+    }
+
+private:
+    static uint64_t new_rows_id();
+    int new_node();
+    bool is_covered(int c) const { return int(right_[left_[c]]) != c; }
+    bool row_has_entries(int r, int nentries, const int *entries) const;
+    void select_node(int r);
+    void split_search(int depth, std::vector<node_t>& path,
+                      std::vector<std::vector<node_t>>& subproblems);
 
-        if (head_.right == &head_) {
-            return f(k, solution);
+    int copy_selected_rows(node_t *solution) const {
+        int k = selected_.size();
+        for (int i=0; i < k; ++i) {
+            solution[i] = selected_[i];
         }
+        return k;
+    }
+
+    // Where a search has got to. Depths base..k-1 each have a column
+    // covered and a row selected; depth k has chosen nothing yet if
+    // |entering|, and otherwise is about to move on to its next row.
+    struct SearchState {
+        int base;
+        int k;
+        bool entering;
+        dance_result result;
+    };
+
+    template<class F, class Policy>
+    dance_result dancing_search(const F& f, node_t *solution, node_t *columns, Policy& policy)
+    {
+        SearchState s;
+        s.base = this->copy_selected_rows(solution);
+        s.k = s.base;
+        s.entering = true;
+        s.result = {0, false};
+        this->dancing_search(s, f, solution, columns, policy, SIZE_MAX);
+        return s.result;
+    }
+
+    // Runs the search in |s| until it is over (and returns true) or
+    // has visited |max_nodes| more nodes. Rather than recursing, it
+    // keeps the stack of chosen columns in |columns| and the stack of
+    // chosen rows in |solution|, where the callback expects them.
+    template<class F, class Policy>
+    bool dancing_search(SearchState& s, const F& f, node_t *solution, node_t *columns,
+                        Policy& policy, size_t max_nodes)
+    {
+        const int base = s.base;
+        int k = s.k;
+        bool entering = s.entering;
+        int updates = 0;
+        int covers = 0;
+
+        while (k >= base) {
+            if (entering) {
+                if (right_[0] == 0) {
+                    dance_result subresult = f(k, (const node_t *)solution);
+                    s.result.count += subresult.count;
+                    if (subresult.short_circuit) {
+                        s.result.short_circuit = true;
+                        break;
+                    }
+                    k -= 1;
+                    entering = false;
+                    continue;
+                }
+                if (interrupt_ != nullptr && interrupt_->load(std::memory_order_relaxed)) {
+                    s.result.short_circuit = true;
+                    break;
+                }
+                if (max_nodes == 0) {
+                    s.k = k;
+                    s.entering = true;
+                    break;
+                }
+                max_nodes -= 1;
 
-        /* Choose a column object |c|. */
-        struct column_object *c = nullptr;
-        if (true) {
-            int minsize = INT_MAX;
-            for (auto j = head_.right; j != &head_; j = j->right) {
-                auto jj = &j->as<column_object>();
-                if (jj->size < minsize) {
-                    c = jj;
-                    minsize = jj->size;
-                    if (minsize <= 1) break;
+                /* Choose a column object |c|, and cover it. */
+                int c = policy.choose(*this);
+                this->record_node(k, c);
+                updates += dancing_cover(c);
+                covers += 1;
+                columns[k] = c;
+                solution[k] = down_[c];
+            } else {
+                /* Back from depth k+1: put row solution[k] back, and move on. */
+                int r = solution[k];
+                for (int j = left_[r]; j != r; j = left_[j]) {
+                    dancing_uncover(col_[j]);
                 }
+                solution[k] = down_[r];
             }
+
+            int c = columns[k];
+            int r = solution[k];
+            if (r == c) {
+                /* Out of rows: uncover column |c| and return. */
+                dancing_uncover(c);
+                k -= 1;
+                entering = false;
+                continue;
+            }
+            for (int j = right_[r]; j != r; j = right_[j]) {
+                updates += dancing_cover(col_[j]);
+                covers += 1;
+            }
+            k += 1;
+            entering = true;
         }
 
-        /* Cover column |c|. */
-        dancing_cover(c);
+        this->record_covers(covers, updates);
+        if (k >= base && entering && !s.result.short_circuit) {
+            return false;  // suspended
+        }
+        if (s.result.short_circuit) {
+            // Unwind all the way, so that the matrix is left intact
+            // for the next solve().
+            s.k = k;
+            this->unwind_search(s, solution, columns);
+        }
+        s.k = base - 1;
+        return true;
+    }
 
-        for (auto r = c->down; r != c; r = r->down) {
-            solution[k] = r;
-            for (auto j = r->right; j != r; j = j->right) {
-                dancing_cover(j->column);
+    // Undoes depths s.base..s.k-1 of a search that stopped at the
+    // start of depth s.k.
+    void unwind_search(SearchState& s, const node_t *solution, const node_t *columns)
+    {
+        for (int d = s.k - 1; d >= s.base; --d) {
+            int r = solution[d];
+            for (int j = left_[r]; j != r; j = left_[j]) {
+                dancing_uncover(col_[j]);
             }
-            dance_result subresult = this->dancing_search(k+1, f, solution);
-            result.count += subresult.count;
-            if (subresult.short_circuit) {
-                result.short_circuit = true;
-                return result;
+            dancing_uncover(columns[d]);
+        }
+        s.k = s.base - 1;
+    }
+
+    // |depth| is only for DanceStats.
+    template<class Policy>
+    int counting_search(int depth, int limit, DanceCountCache& cache, uint64_t *key, uint64_t hash,
+                        Policy& policy)
+    {
+        if (right_[0] == 0) {
+            return 1;
+        }
+        int count;
+        if (cache.lookup(hash, key, &count)) {
+            cache.hits += 1;
+            return count;
+        }
+        cache.misses += 1;
+
+        count = 0;
+        int c = policy.choose(*this);
+        this->record_node(depth, c);
+        int updates = dancing_cover(c);
+        int covers = 1;
+        key[(c-1) / 64] &= ~(uint64_t(1) << ((c-1) % 64));
+        hash ^= cache.column_hash(c);
+        for (int r = down_[c]; r != c; r = down_[r]) {
+            uint64_t subhash = hash;
+            for (int j = right_[r]; j != r; j = right_[j]) {
+                int cj = col_[j];
+                updates += dancing_cover(cj);
+                covers += 1;
+                key[(cj-1) / 64] &= ~(uint64_t(1) << ((cj-1) % 64));
+                subhash ^= cache.column_hash(cj);
+            }
+            count += this->counting_search(depth+1, limit, cache, key, subhash, policy);
+            for (int j = left_[r]; j != r; j = left_[j]) {
+                int cj = col_[j];
+                dancing_uncover(cj);
+                key[(cj-1) / 64] |= uint64_t(1) << ((cj-1) % 64);
             }
-            r = solution[k];
-            c = r->column;
-            for (auto j = r->left; j != r; j = j->left) {
-                dancing_uncover(j->column);
+            if (count >= limit) {
+                count = limit;
+                break;
             }
         }
+        dancing_uncover(c);
+        key[(c-1) / 64] |= uint64_t(1) << ((c-1) % 64);
+        hash ^= cache.column_hash(c);
+        this->record_covers(covers, updates);
 
-        /* Uncover column |c| and return. */
+        cache.insert(hash, key, count);
+        return count;
+    }
+
+    template<class Accept, class F, class Policy>
+    dance_result grouping_search(int i, int n, const int *columns, int *rows, int cap,
+                                 const Accept& accept, const F& f, Policy& policy)
+    {
+        if (i == n) {
+            int count = 0;
+            auto counter = [cap, &count](int, const node_t *) {
+                dance_result result;
+                result.count = 1;
+                result.short_circuit = (++count >= cap);
+                return result;
+            };
+            // For DanceStats, this search's depths start again after the
+            // selected rows, as if the grouped columns weren't covered.
+            dance_result result = this->dancing_search(counter, solution_.data(), columns_.data(), policy);
+            result.short_circuit = f((const int *)rows, result.count);
+            return result;
+        }
+        dance_result result = {0, false};
+        int c = columns[i] + 1;
+        assert(!is_covered(c));
+        this->record_node(num_selected_rows() + i, c);
+        int updates = dancing_cover(c);
+        int covers = 1;
+        for (int r = down_[c]; r != c && !result.short_circuit; r = down_[r]) {
+            rows[i] = row_[r];
+            if (!accept(i, (const int *)rows)) continue;
+            for (int j = right_[r]; j != r; j = right_[j]) {
+                updates += dancing_cover(col_[j]);
+                covers += 1;
+            }
+            dance_result subresult = this->grouping_search(i+1, n, columns, rows, cap, accept, f, policy);
+            for (int j = left_[r]; j != r; j = left_[j]) {
+                dancing_uncover(col_[j]);
+            }
+            result.count += subresult.count;
+            result.short_circuit = subresult.short_circuit;
+        }
         dancing_uncover(c);
+        this->record_covers(covers, updates);
         return result;
     }
 
-    static void dancing_cover(struct column_object *c)
+    // DanceStats bookkeeping for a search node at |depth| that
+    // branches on column |c|, and for the covers a search made.
+    void record_node(int depth, int c)
     {
-        auto cright = c->right;
-        auto cleft = c->left;
-        cright->left = cleft;
-        cleft->right = cright;
-        for (auto i = c->down; i != c; i = i->down) {
-            for (auto j = i->right; j != i; j = j->right) {
-                auto jup = j->up;
-                auto jdown = j->down;
-                jdown->up = jup;
-                jup->down = jdown;
-                j->column->size -= 1;
+#if DANCE_STATS
+        if (stats_ != nullptr) {
+            int d = (depth < DanceStats::max_depth) ? depth : DanceStats::max_depth - 1;
+            int b = (col_[c] < DanceStats::max_branching) ? col_[c] : DanceStats::max_branching - 1;
+            stats_->nodes += 1;
+            stats_->dead_ends += (col_[c] == 0);
+            stats_->deepest = (depth > stats_->deepest) ? depth : stats_->deepest;
+            stats_->branching[d][b] += 1;
+        }
+#endif
+        (void)depth;
+        (void)c;
+    }
+
+    void record_covers(int covers, int updates)
+    {
+#if DANCE_STATS
+        if (stats_ != nullptr) {
+            stats_->covers += covers;
+            stats_->updates += updates;
+        }
+#endif
+        (void)covers;
+        (void)updates;
+    }
+
+    // Returns the number of nodes unlinked, for DanceStats.
+    int dancing_cover(int c)
+    {
+        int updates = 0;
+        int cright = right_[c];
+        int cleft = left_[c];
+        left_[cright] = cleft;
+        right_[cleft] = cright;
+        for (int i = down_[c]; i != c; i = down_[i]) {
+            for (int j = right_[i]; j != i; j = right_[j]) {
+                int jup = up_[j];
+                int jdown = down_[j];
+                up_[jdown] = jup;
+                down_[jup] = jdown;
+                col_[col_[j]] -= 1;
+                updates += 1;
             }
         }
+        return updates;
     }
 
-    static void dancing_uncover(struct column_object *c)
+    void dancing_uncover(int c)
     {
-        for (auto i = c->up; i != c; i = i->up) {
-            for (auto j = i->left; j != i; j = j->left) {
-                j->column->size += 1;
-                j->down->up = j;
-                j->up->down = j;
+        for (int i = up_[c]; i != c; i = up_[i]) {
+            for (int j = left_[i]; j != i; j = left_[j]) {
+                col_[col_[j]] += 1;
+                up_[down_[j]] = j;
+                down_[up_[j]] = j;
             }
         }
-        c->left->right = c;
-        c->right->left = c;
+        right_[left_[c]] = c;
+        left_[right_[c]] = c;
     }
 
 public:
-    int nrows_;
+    int nrows_ = 0;
 private:
-    int ncolumns_;
-    DancePtr<column_object> columns_;
-    column_object head_;
-    size_t arena_used_ = 0;
-    alignas(8) char memory_arena_[120000];
+    int ncolumns_ = 0;
+    int nnodes_ = 0;
+    // Names this set of rows, for DanceCountCache: init() and addrow()
+    // take a new one, unique to the process, and copies share it.
+    uint64_t rows_id_ = 0;
+    std::vector<node_t> selected_;
+    std::vector<node_t> solution_;  // reused by each solve()
+    std::vector<node_t> columns_;  // and this too
+    std::vector<uint64_t> count_key_;  // and this by count_solutions()
+    std::vector<int> group_rows_;  // and this by count_solutions_by_rows()
+    SearchState search_ = {0, -1, false, {0, false}};  // for begin_search()
+    const std::atomic<bool> *interrupt_ = nullptr;  // set only by solve_in_parallel
+    DanceStats *stats_ = nullptr;
+    // For a column header, col_ holds the column's current size instead.
+    typename Storage::template array<node_t> up_;
+    typename Storage::template array<node_t> down_;
+    typename Storage::template array<node_t> left_;
+    typename Storage::template array<node_t> right_;
+    typename Storage::template array<node_t> col_;
+    typename Storage::template array<node_t> row_;  // of data nodes only
+};
+
+// The 4096-node default covers a 9x9 Sudoku with all 729 candidate
+// rows in 16-bit indices; the growable variant is for everything else.
+using DanceMatrix = BasicDanceMatrix<FixedDanceStorage<4096>>;
+using GrowableDanceMatrix = BasicDanceMatrix<GrowableDanceStorage<>>;
+using dance_node_t = DanceMatrix::node_t;
+
+// Column-selection policies for BasicDanceMatrix::solve(). Each one picks
+// the uncovered column that the search branches on next, and counts
+// the search nodes at which it was asked.
+
+// Knuth's heuristic: the column with the fewest rows.
+struct MinimumRemainingValues {
+    size_t nodes = 0;
+
+    template<class Matrix>
+    int choose(const Matrix& mat) {
+        nodes += 1;
+        int c = 0;
+        int minsize = INT_MAX;
+        for (int j = mat.first_column(); j != 0; j = mat.next_column(j)) {
+            int size = mat.column_size(j);
+            if (size < minsize) {
+                c = j;
+                minsize = size;
+                if (minsize <= 1) break;
+            }
+        }
+        return c;
+    }
+};
+
+// The column with the fewest rows, breaking ties in favor of the
+// lowest Rank()(column_number), which must lie in 0..255. For Sudoku,
+// Rank can prefer cell columns to row, column and box columns.
+template<class Rank>
+struct MinimumRemainingValuesBy {
+    size_t nodes = 0;
+
+    template<class Matrix>
+    int choose(const Matrix& mat) {
+        nodes += 1;
+        int c = 0;
+        int minkey = INT_MAX;
+        for (int j = mat.first_column(); j != 0; j = mat.next_column(j)) {
+            int key = (mat.column_size(j) << 8) | Rank()(mat.column_number(j));
+            if (key < minkey) {
+                c = j;
+                minkey = key;
+                if (minkey < (2 << 8)) break;
+            }
+        }
+        return c;
+    }
+};
+
+// The column with the fewest rows, breaking ties pseudo-randomly.
+// A fresh salt at each node permutes the columns' tie-break keys.
+struct MinimumRemainingValuesRandomTies {
+    size_t nodes = 0;
+    uint32_t seed = 2463534242u;
+
+    template<class Matrix>
+    int choose(const Matrix& mat) {
+        nodes += 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int salt = seed & 0xFFFF;
+        int c = 0;
+        int minkey = INT_MAX;
+        for (int j = mat.first_column(); j != 0; j = mat.next_column(j)) {
+            int key = (mat.column_size(j) << 16) | (((j * 40503) ^ salt) & 0xFFFF);
+            if (key < minkey) {
+                c = j;
+                minkey = key;
+                if (minkey < (2 << 16)) break;
+            }
+        }
+        return c;
+    }
+};
+
+// The uncovered column that comes first in the fixed order given by
+// Rank()(column_number), except that an empty column is taken at once.
+template<class Rank>
+struct StaticColumnOrder {
+    size_t nodes = 0;
+
+    template<class Matrix>
+    int choose(const Matrix& mat) {
+        nodes += 1;
+        int c = 0;
+        int minrank = INT_MAX;
+        for (int j = mat.first_column(); j != 0; j = mat.next_column(j)) {
+            if (mat.column_size(j) == 0) return j;
+            int rank = Rank()(mat.column_number(j));
+            if (rank < minrank) {
+                c = j;
+                minrank = rank;
+            }
+        }
+        return c;
+    }
 };
+
+template<class Storage>
+template<class F>
+int BasicDanceMatrix<Storage>::solve(const F& f)
+{
+    return this->solve(f, MinimumRemainingValues());
+}
+
+template<class Storage>
+int BasicDanceMatrix<Storage>::count_solutions(int limit, DanceCountCache& cache)
+{
+    return this->count_solutions(limit, cache, MinimumRemainingValues());
+}
+
+template<class Storage>
+template<int RowsInSolution, class F>
+int BasicDanceMatrix<Storage>::solve(const F& f)
+{
+    return this->template solve<RowsInSolution>(f, MinimumRemainingValues());
+}
+
+template<class Storage>
+template<class F>
+int BasicDanceMatrix<Storage>::solve_in_parallel(const F& f, int nthreads, int split_depth)
+{
+    return this->solve_in_parallel(f, nthreads, split_depth, MinimumRemainingValues());
+}
@@ -2,14 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "dance.h"
 #include "sudoku.h"
 #include "odo-sudoku.h"
 #include "work-queue.h"
 
-static size_t count_of_viable_grids = 0;
-
 Odometer odometer_from_grid(const int grid[9][9])
 {
     // Filling the grid in non-reading order actually
@@ -31,22 +32,14 @@ Odometer odometer_from_grid(const int grid[9][9])
     for (int pre_idx = 0; pre_idx < 81; ++pre_idx) {
         int idx = transform_idx[pre_idx];
         if (grid[idx/9][idx%9] == 0) continue;
-        OdometerWheel new_wheel(idx);
-        for (int i=0; i < odometer.num_wheels; ++i) {
-            int pc = odometer.wheels[i].idx;
-            bool same_row = (pc / 9 == idx / 9);
-            bool same_col = (pc % 9 == idx % 9);
-            bool same_box = ((pc / 9) / 3 == (idx / 9) / 3) && ((pc % 9) / 3 == (idx % 9) / 3);
-            if (same_row || same_col || same_box) {
-                new_wheel.add_conflict(i);
-            }
-        }
-        odometer.add_wheel(new_wheel);
+        odometer.add_wheel_for_cell(idx);
     }
     return odometer;
 }
 
-void odometer_to_grid(const Odometer& odometer, int grid[9][9])
+// If |solution| is given, it is a solution to the odometer's grid,
+// and it gets relabeled to match.
+void odometer_to_grid(const Odometer& odometer, int grid[9][9], int (*solution)[9] = nullptr)
 {
     memset(grid, '\0', 81 * sizeof(int));
     for (int i=0; i < odometer.num_wheels; ++i) {
@@ -58,29 +51,24 @@ void odometer_to_grid(const Odometer& odometer, int grid[9][9])
     // However, since we fill the squares in non-reading order, we
     // should actually remap the numbers so that they *do* read in
     // reading order (starting with '1' in the upper-left-most position).
-    int mapping[10] {};
-    int next_unseen_value = 1;
+    Relabeling relabel;
     for (int i=0; i < 81; ++i) {
-        int value = grid[i/9][i%9];
-        if (value == 0) continue;
-        if (mapping[value] == 0) {
-            mapping[value] = next_unseen_value++;
+        if (grid[i/9][i%9] != 0) {
+            grid[i/9][i%9] = relabel(grid[i/9][i%9]);
         }
-        grid[i/9][i%9] = mapping[value];
     }
-}
-
-bool has_prior_conflict(const Odometer& odometer, const OdometerWheel& wheel, int value)
-{
-    for (int i=0; i < wheel.num_conflicts; ++i) {
-        if (odometer.wheels[wheel.conflicts[i]].value == value) {
-            return true;
+    if (solution != nullptr) {
+        for (int i=0; i < 81; ++i) {
+            solution[i/9][i%9] = relabel(solution[i/9][i%9]);
         }
     }
-    return false;
 }
 
-struct Taskmaster : public RoundRobinPool<Workspace, Odometer, NUM_THREADS, Taskmaster>
+// Workers pop this many odometers at a time, so that the solver
+// can check them all in one lockstep call.
+static constexpr int ODOMETERS_PER_BATCH = 16;
+
+struct Taskmaster : public RoundRobinPool<Workspace, Odometer, NUM_THREADS, Taskmaster, ODOMETERS_PER_BATCH>
 {
     std::mutex mtx_;
     std::atomic<int> solutions_{0};
@@ -103,23 +91,41 @@ struct Taskmaster : public RoundRobinPool<Workspace, Odometer, NUM_THREADS, Task
         return count;
     }
 
-    void process(Workspace& workspace, const Odometer& odometer) {
-        workspace.complete_odometer_sudoku(odometer);
-        int solution_count = workspace.count_solutions_to_odometer_sudoku();
-        if (solution_count == 1) {
-            std::lock_guard<std::mutex> lk(mtx_);
-            printf("This sudoku grid was a meta solution!\n");
-            int grid[9][9];
-            odometer_to_grid(odometer, grid);
-            print_sudoku_grid(grid);
-            printf("The unique solution to the sudoku grid above is:\n");
-            print_unique_sudoku_solution(grid);
-            int found = ++solutions_;
-            if (found >= 2) {
-                throw ConsumerShutDownException();
+#if DANCE_STATS
+    void print_search_stats() {
+        DanceStats stats;
+        this->for_each_state([&](const Workspace& workspace) {
+            stats.add(workspace.stats);
+        });
+        stats.print();
+    }
+#endif
+
+    void report_meta_solution(const Odometer& odometer, int solution[9][9]) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        printf("This sudoku grid was a meta solution!\n");
+        int grid[9][9];
+        odometer_to_grid(odometer, grid, solution);
+        print_sudoku_grid(grid);
+        printf("The unique solution to the sudoku grid above is:\n");
+        printf("-----\n");
+        print_sudoku_grid(solution);
+        int found = ++solutions_;
+        if (found >= 2) {
+            throw ConsumerShutDownException();
+        }
+    }
+
+    void process_batch(Workspace& workspace, Odometer *odometers, int n) {
+        int solution_counts[ODOMETERS_PER_BATCH];
+        int solutions[ODOMETERS_PER_BATCH][9][9];
+        workspace.count_solutions_to_odometer_sudokus(odometers, n, solution_counts, solutions);
+        for (int i=0; i < n; ++i) {
+            if (solution_counts[i] == 1) {
+                report_meta_solution(odometers[i], solutions[i]);
             }
         }
-        workspace.processed += 1;
+        workspace.processed += n;
     }
 };
 
@@ -130,25 +136,11 @@ static size_t grids_per_second(size_t grids)
     return (1000 * grids / (elapsed.count() + 1));
 }
 
-template<int SHORT_CUT_FACTOR>
-constexpr size_t pow9() {
-    static_assert(SHORT_CUT_FACTOR <= 16, "9**16 is 2**50");
-    size_t result = 1;
-    for (int i = 0; i < SHORT_CUT_FACTOR; ++i) result *= 9;
-    return result;
-}
-
 template<int SHORT_CUT_FACTOR>
 int count_solutions_with_odometer(Taskmaster& taskmaster, Odometer& odometer, int wheel_idx, int next_unseen_value)
 {
     if (wheel_idx == odometer.num_wheels - SHORT_CUT_FACTOR) {
         if (SHORT_CUT_FACTOR != 0 || next_unseen_value >= 9) {
-#if JUST_COUNT_VIABLE_GRIDS
-            count_of_viable_grids += pow9<SHORT_CUT_FACTOR>();
-            if ((count_of_viable_grids & 0xFFFF) == 0) {
-                printf("\rmeta %zu", count_of_viable_grids);
-            }
-#else
             size_t counter = taskmaster.count_pushed();
             if ((counter & 0xFFFF) == 0) {
                 size_t processed = taskmaster.count_processed();
@@ -166,15 +158,15 @@ int count_solutions_with_odometer(Taskmaster& taskmaster, Odometer& odometer, in
                 fflush(stdout);
             }
             taskmaster.push(odometer);
-#endif
         }
         return 0;
     }
 
     OdometerWheel *wheel = &odometer.wheels[wheel_idx];
     int result = 0;
-    for (int value = 1; value < next_unseen_value; ++value) {
-        if (has_prior_conflict(odometer, *wheel, value)) continue;
+    uint32_t allowed = ~odometer.conflicting_values(wheel_idx) & ((1u << next_unseen_value) - 2);
+    for (; allowed != 0; allowed &= allowed - 1) {
+        int value = __builtin_ctz(allowed);
         wheel->value = value;
         result += count_solutions_with_odometer<SHORT_CUT_FACTOR>(taskmaster, odometer, wheel_idx+1, next_unseen_value);
         if (result >= 2) {
@@ -194,7 +186,7 @@ bool metasudoku_has_exactly_one_solution(const int grid[9][9])
 {
     Taskmaster taskmaster;
     taskmaster.for_each_state([&](Workspace& workspace) {
-        workspace.begin_odometer_sudoku(grid);
+        workspace.begin_odometer_sudoku();
     });
     taskmaster.start_threads();
 
@@ -208,6 +200,9 @@ bool metasudoku_has_exactly_one_solution(const int grid[9][9])
 
     taskmaster.shutdown_when_empty();
     taskmaster.wait();
+#if DANCE_STATS
+    taskmaster.print_search_stats();
+#endif
     int num_solutions = taskmaster.solutions_;
     printf("num_solutions is %d\n", num_solutions);
     return num_solutions == 1;
@@ -310,19 +305,35 @@ int main()
 
     FILE *in = fopen("unique-configs-as-grids.txt", "r");
     assert(in != nullptr);
-    int counter = 0;
+    std::vector<std::string> lines;
     char buf[100];
     while (fgets(buf, sizeof buf, in) != nullptr) {
         assert(strlen(buf) == 82);
         buf[81] = '\0';
+        lines.push_back(buf);
+    }
 
-        ++counter;
-
-        int grid[9][9];
-        string_to_grid(buf, grid);
-        if (count_sudoku_solutions(grid) != 1) {
+    // Check that every configuration is a proper Sudoku up front,
+    // in one batch, before the slow part.
+    size_t n = lines.size();
+    std::unique_ptr<int[][9][9]> grids(new int[n][9][9]);
+    std::vector<int> solution_counts(n);
+    for (size_t i=0; i < n; ++i) {
+        string_to_grid(lines[i].c_str(), grids[i]);
+    }
+    count_sudoku_solutions_batch(grids.get(), n, solution_counts.data(), 2);
+    for (size_t i=0; i < n; ++i) {
+        if (solution_counts[i] != 1) {
             puts("FAILED SELF TEST"); exit(1);
         }
+    }
+
+    int counter = 0;
+    for (size_t i=0; i < n; ++i) {
+        const char *buf = lines[i].c_str();
+        const auto& grid = grids[i];
+
+        ++counter;
 
         if (grid_obviously_has_multiple_solutions(grid)) {
             printf("."); fflush(stdout); continue;
@@ -331,11 +342,8 @@ int main()
         }
 
 #if JUST_COUNT_VIABLE_GRIDS
-        Taskmaster dummy;
         Odometer odometer = odometer_from_grid(grid);
-        count_of_viable_grids = 0;
-        count_solutions_with_odometer<0>(dummy, odometer, 0, 1);
-        printf("\nmetasudoku %d: count of viable grids is %zu\n", counter, count_of_viable_grids);
+        printf("\nmetasudoku %d: count of viable grids is %zu\n", counter, count_odometer_settings(odometer, 8));
 #else
         bool r = metasudoku_has_exactly_one_solution(grid);
         printf("metasudoku %d %s have exactly one solution\n", counter, r ? "does" : "does not");
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <array>
+#include <type_traits>
+#include <vector>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +14,60 @@
 
 static size_t count_of_viable_grids = 0;
 
+// The order of the wheels can come from the table in
+// odometer_from_grid(), or from the clue pattern itself, as DSATUR
+// would color it: each wheel goes to the clue cell with the most
+// peers among the cells with wheels so far (which is as many values
+// as it could be kept from taking), breaking ties by the most peers
+// among the rest. DSATUR proper would choose by the values actually
+// set, wheel by wheel, but everything here (the workers' subtrees,
+// the nogoods, the symmetries) needs one order for all odometers.
+// On the gordon-royle pattern this makes the tree of odometers 6%
+// smaller than the table does, and the producer's part of it half
+// the size, so that each subtree holds twice as many odometers.
+static constexpr bool ORDER_WHEELS_BY_SATURATION = true;
+
+template<int BoxSize>
+static BasicOdometer<BoxSize> odometer_by_saturation(const int grid[][BoxSize * BoxSize])
+{
+    using Shape = SudokuShape<BoxSize>;
+    constexpr int N = Shape::N;
+    BasicOdometer<BoxSize> odometer;
+    bool has_wheel[Shape::num_cells] = {};
+    int num_clues = 0;
+    for (int idx = 0; idx < Shape::num_cells; ++idx) {
+        num_clues += (grid[idx/N][idx%N] != 0);
+    }
+    for (int k = 0; k < num_clues; ++k) {
+        int best_idx = -1;
+        int best_saturation = -1;
+        int best_degree = -1;
+        for (int idx = 0; idx < Shape::num_cells; ++idx) {
+            if (grid[idx/N][idx%N] == 0 || has_wheel[idx]) continue;
+            int saturation = 0;
+            int degree = 0;
+            for (int j = 0; j < Shape::num_cells; ++j) {
+                if (grid[j/N][j%N] == 0 || j == idx || !Shape::are_peers(idx, j)) continue;
+                if (has_wheel[j]) saturation += 1; else degree += 1;
+            }
+            if (saturation > best_saturation || (saturation == best_saturation && degree > best_degree)) {
+                best_idx = idx;
+                best_saturation = saturation;
+                best_degree = degree;
+            }
+        }
+        has_wheel[best_idx] = true;
+        odometer.add_wheel_for_cell(best_idx);
+    }
+    return odometer;
+}
+
 Odometer odometer_from_grid(const int grid[9][9])
 {
+    if (ORDER_WHEELS_BY_SATURATION) {
+        return odometer_by_saturation<3>(grid);
+    }
+
     // Filling the grid in non-reading order actually
     // helps us find solvable Sudokus more quickly.
     // The particular order chosen here is arbitrary.
@@ -30,22 +87,14 @@ Odometer odometer_from_grid(const int grid[9][9])
     for (int pre_idx = 0; pre_idx < 81; ++pre_idx) {
         int idx = transform_idx[pre_idx];
         if (grid[idx/9][idx%9] == 0) continue;
-        OdometerWheel new_wheel(idx);
-        for (int i=0; i < odometer.num_wheels; ++i) {
-            int pc = odometer.wheels[i].idx;
-            bool same_row = (pc / 9 == idx / 9);
-            bool same_col = (pc % 9 == idx % 9);
-            bool same_box = ((pc / 9) / 3 == (idx / 9) / 3) && ((pc % 9) / 3 == (idx % 9) / 3);
-            if (same_row || same_col || same_box) {
-                new_wheel.add_conflict(i);
-            }
-        }
-        odometer.add_wheel(new_wheel);
+        odometer.add_wheel_for_cell(idx);
     }
     return odometer;
 }
 
-void odometer_to_grid(const Odometer& odometer, int grid[9][9])
+// If |solution| is given, it is a solution to the odometer's grid,
+// and it gets relabeled to match.
+void odometer_to_grid(const Odometer& odometer, int grid[9][9], int (*solution)[9] = nullptr)
 {
     memset(grid, '\0', 81 * sizeof(int));
     for (int i=0; i < odometer.num_wheels; ++i) {
@@ -57,32 +106,303 @@ void odometer_to_grid(const Odometer& odometer, int grid[9][9])
     // However, since we fill the squares in non-reading order, we
     // should actually remap the numbers so that they *do* read in
     // reading order (starting with '1' in the upper-left-most position).
-    int mapping[10] {};
-    int next_unseen_value = 1;
+    Relabeling relabel;
     for (int i=0; i < 81; ++i) {
-        int value = grid[i/9][i%9];
-        if (value == 0) continue;
-        if (mapping[value] == 0) {
-            mapping[value] = next_unseen_value++;
+        if (grid[i/9][i%9] != 0) {
+            grid[i/9][i%9] = relabel(grid[i/9][i%9]);
+        }
+    }
+    if (solution != nullptr) {
+        for (int i=0; i < 81; ++i) {
+            solution[i/9][i%9] = relabel(solution[i/9][i%9]);
+        }
+    }
+}
+
+// The geometric symmetries of Sudoku (permuting the rows within each
+// band, the bands, the columns within each stack, and the stacks, and
+// transposing) that map the clue pattern onto itself. Each one, with
+// relabeling, maps a candidate to another with as many solutions, so
+// of each orbit only the least candidate needs checking, if the rest
+// are counted with it. Candidates compare as their values in wheel
+// order, which the odometer already labels in order of appearance.
+template<int BoxSize>
+struct BasicPatternSymmetries {
+    using Odometer = BasicOdometer<BoxSize>;
+    static constexpr int num_cells = SudokuShape<BoxSize>::num_cells;
+
+    // For each symmetry other than the identity, the wheel whose cell
+    // maps to each wheel's cell. Symmetries that move the same cells
+    // the same way are one symmetry here.
+    std::vector<std::array<int, num_cells>> sources;
+
+    int group_order() const { return sources.size() + 1; }
+
+    // Whether the first |n| wheels could still begin the least
+    // candidate of its orbit: no symmetry maps them to something that
+    // is already known to come earlier.
+    bool may_be_least(const Odometer& odometer, int n) const {
+        for (const auto& source : sources) {
+            if (compare_image(odometer, n, source) < 0) return false;
+        }
+        return true;
+    }
+
+    // How many candidates the symmetries make of this one, which must
+    // be complete and the least of them.
+    int orbit_size(const Odometer& odometer) const {
+        int stabilizer_order = 1;
+        for (const auto& source : sources) {
+            stabilizer_order += (compare_image(odometer, odometer.num_wheels, source) == 0);
+        }
+        return group_order() / stabilizer_order;
+    }
+
+private:
+    // Compares the image of the first |n| wheels with the wheels
+    // themselves, as far as both are known; zero means no difference
+    // is known yet.
+    static int compare_image(const Odometer& odometer, int n, const std::array<int, num_cells>& source) {
+        BasicRelabeling<BoxSize> relabel;
+        for (int k=0; k < n && source[k] < n; ++k) {
+            int label = relabel(odometer.wheels[source[k]].value);
+            if (label != odometer.wheels[k].value) {
+                return label - odometer.wheels[k].value;
+            }
+        }
+        return 0;
+    }
+};
+
+using PatternSymmetries = BasicPatternSymmetries<3>;
+
+// The maps of the rows that permute the rows within each band and the
+// bands themselves (and likewise of the columns): BoxSize!**(BoxSize+1)
+// of them, which for 9x9 is 6**4.
+template<int BoxSize>
+static std::vector<std::array<int, BoxSize*BoxSize>> band_preserving_maps()
+{
+    std::vector<std::array<int, BoxSize>> perms;
+    std::array<int, BoxSize> p;
+    for (int i=0; i < BoxSize; ++i) p[i] = i;
+    do {
+        perms.push_back(p);
+    } while (std::next_permutation(p.begin(), p.end()));
+
+    // choice[0] picks the permutation of the bands, and choice[1+b]
+    // that of the rows within band b.
+    std::vector<std::array<int, BoxSize*BoxSize>> maps;
+    std::array<int, BoxSize+1> choice = {};
+    while (true) {
+        std::array<int, BoxSize*BoxSize> map;
+        for (int i=0; i < BoxSize*BoxSize; ++i) {
+            map[i] = BoxSize*perms[choice[0]][i/BoxSize] + perms[choice[1 + i/BoxSize]][i%BoxSize];
         }
-        grid[i/9][i%9] = mapping[value];
+        maps.push_back(map);
+        int j = BoxSize;
+        while (j >= 0 && ++choice[j] == (int)perms.size()) {
+            choice[j] = 0;
+            j -= 1;
+        }
+        if (j < 0) break;
     }
+    return maps;
 }
 
-bool has_prior_conflict(const Odometer& odometer, const OdometerWheel& wheel, int value)
+template<int BoxSize>
+BasicPatternSymmetries<BoxSize> find_pattern_symmetries(const BasicOdometer<BoxSize>& odometer)
 {
-    for (int i=0; i < wheel.num_conflicts; ++i) {
-        if (odometer.wheels[wheel.conflicts[i]].value == value) {
-            return true;
+    // For 16x16 there would be 24**5 maps of the rows, and as many of
+    // the columns, to try in pairs.
+    static_assert(BoxSize <= 3, "trying every symmetry is only feasible up to 9x9");
+    constexpr int N = SudokuShape<BoxSize>::N;
+    constexpr int num_cells = SudokuShape<BoxSize>::num_cells;
+    int wheel_at[num_cells];
+    int row_count[N] = {};
+    int col_count[N] = {};
+    std::fill(wheel_at, wheel_at + num_cells, -1);
+    for (int i=0; i < odometer.num_wheels; ++i) {
+        int idx = odometer.wheels[i].idx;
+        wheel_at[idx] = i;
+        row_count[idx / N] += 1;
+        col_count[idx % N] += 1;
+    }
+
+    // Trying all 3359232 symmetries of 9x9 takes a moment, but most of
+    // the maps can't work, since they'd move a row (or column) to one
+    // with a different number of clues.
+    std::vector<std::array<int, N>> maps = band_preserving_maps<BoxSize>();
+    BasicPatternSymmetries<BoxSize> result;
+    for (int transpose = 0; transpose < 2; ++transpose) {
+        const int *row_target_count = transpose ? col_count : row_count;
+        const int *col_target_count = transpose ? row_count : col_count;
+        std::vector<const std::array<int, N> *> row_maps;
+        std::vector<const std::array<int, N> *> col_maps;
+        for (const auto& map : maps) {
+            bool rows_ok = true;
+            bool cols_ok = true;
+            for (int i=0; i < N; ++i) {
+                rows_ok = rows_ok && (row_count[i] == row_target_count[map[i]]);
+                cols_ok = cols_ok && (col_count[i] == col_target_count[map[i]]);
+            }
+            if (rows_ok) row_maps.push_back(&map);
+            if (cols_ok) col_maps.push_back(&map);
+        }
+        for (const auto *row_map : row_maps) {
+            for (const auto *col_map : col_maps) {
+                std::array<int, num_cells> source;
+                bool is_identity = true;
+                bool ok = true;
+                for (int i=0; i < odometer.num_wheels && ok; ++i) {
+                    int idx = odometer.wheels[i].idx;
+                    int row = (*row_map)[idx / N];
+                    int col = (*col_map)[idx % N];
+                    int image = transpose ? (N*col + row) : (N*row + col);
+                    ok = (wheel_at[image] != -1);
+                    if (ok) source[wheel_at[image]] = i;
+                    is_identity = is_identity && (image == idx);
+                }
+                if (ok && !is_identity) {
+                    result.sources.push_back(source);
+                }
+            }
         }
     }
-    return false;
+    // Symmetries that differ only on empty cells (say, swapping two
+    // empty rows) do the same to the candidates, and count only once.
+    for (auto& source : result.sources) {
+        std::fill(source.begin() + odometer.num_wheels, source.end(), 0);
+    }
+    std::sort(result.sources.begin(), result.sources.end());
+    result.sources.erase(std::unique(result.sources.begin(), result.sources.end()), result.sources.end());
+    return result;
 }
 
-struct Taskmaster : public RoundRobinPool<Workspace, Odometer, NUM_THREADS, Taskmaster>
+// Rather than single odometers, workers get whole subtrees: the
+// odometer with all but this many wheels set. Each worker turns the
+// remaining wheels itself, selecting just one clue per turn, and so
+// the queues carry far fewer (and no smaller) tasks.
+static constexpr int WHEELS_PER_SUBTREE = 3;
+
+// Until there are fewer than this many wheels left to turn, the
+// producer checks that the wheels so far leave the grid a solution
+// at all, and skips the whole subtree if not. A check costs about as
+// much as checking one candidate, so checking much deeper than this
+// costs the producer more than it saves the workers. Zero turns the
+// checks off.
+static constexpr int PRUNE_DOWN_TO_WHEELS_LEFT = 6;
+
+// Whenever some wheels turn out to leave the grid no solution, the
+// producer or worker that found out shrinks them to a few that still
+// leave none, and files those in the taskmaster's nogood database;
+// from then on, every odometer whose values there fall into the same
+// pattern is skipped as soon as its last such wheel is set. On the
+// gordon-royle pattern, 60 nogoods (mostly of five wheels) skip all
+// but 0.2% of the odometers with no solution; those were cheap to
+// check anyway, so the time is about the same, but it costs little.
+static constexpr bool LEARN_NOGOODS = true;
+
+// A worker can count a whole subtree in one search of its workspace's
+// matrix, which branches on the subtree's wheels first, instead of
+// walking it and counting each odometer on its own. The counts come
+// out the same; in a test on the gordon-royle pattern, counting the
+// subtrees in one search took 20% less time than walking them, though
+// learning nogoods eats most of that.
+static constexpr bool COUNT_SUBTREES_IN_ONE_SEARCH = true;
+
+// A subtree as it waits in a queue: just the values of the wheels
+// before wheel_idx, packed two to a byte (one to a byte once the
+// values outgrow four bits). The wheels themselves, with their
+// conflicts, are the same for every task, so each worker keeps its
+// own copy of the odometer and sets these values in it. (A whole
+// Odometer is over 7 KB, and the queues can hold half a million.)
+template<int BoxSize>
+struct BasicOdometerSubtree {
+    using Odometer = BasicOdometer<BoxSize>;
+    static constexpr int N = SudokuShape<BoxSize>::N;
+    static constexpr int bits_per_value = (N < 16) ? 4 : 8;
+    static constexpr int values_per_byte = 8 / bits_per_value;
+    static constexpr int value_mask = (1 << bits_per_value) - 1;
+    static_assert(N < 256, "values must fit in a byte");
+    using WheelIndex = typename std::conditional<(Odometer::max_wheels < 256), uint8_t, uint16_t>::type;
+
+    std::array<uint8_t, (Odometer::max_wheels + values_per_byte - 1) / values_per_byte> values;
+    WheelIndex wheel_idx;
+    uint8_t next_unseen_value;
+
+    BasicOdometerSubtree() = default;
+    BasicOdometerSubtree(const Odometer& odometer, int wheel_idx, int next_unseen_value) :
+        values(), wheel_idx(wheel_idx), next_unseen_value(next_unseen_value)
+    {
+        for (int i=0; i < wheel_idx; ++i) {
+            values[i / values_per_byte] |= odometer.wheels[i].value << (bits_per_value * (i % values_per_byte));
+        }
+    }
+
+    // Leaves the wheels from wheel_idx on as they were.
+    void unpack_into(Odometer& odometer) const {
+        for (int i=0; i < wheel_idx; ++i) {
+            odometer.wheels[i].value = (values[i / values_per_byte] >> (bits_per_value * (i % values_per_byte))) & value_mask;
+        }
+    }
+};
+
+using OdometerSubtree = BasicOdometerSubtree<3>;
+
+struct Worker : public Workspace {
+    Odometer odometer;  // set up by begin_odometer_sudoku()
+};
+
+struct Taskmaster : public RoundRobinPool<Worker, OdometerSubtree, NUM_THREADS, Taskmaster>
 {
     std::mutex mtx_;
     std::atomic<int> solutions_{0};
+    Workspace pruner_;  // the producer's own, for pruning
+    size_t pruned_ = 0;
+    BasicNogoodDatabase<3> nogoods_;
+    std::atomic<size_t> ruled_out_{0};
+    PatternSymmetries symmetries_;  // none, unless set before starting
+    std::atomic<size_t> symmetric_{0};
+
+    void begin_odometer_sudoku(const Odometer& odometer) {
+        pruner_.begin_odometer_sudoku();
+        this->for_each_state([&](Worker& worker) {
+            worker.begin_odometer_sudoku();
+            worker.odometer = odometer;
+        });
+    }
+
+    bool has_no_completion(const Odometer& odometer, int wheel_idx) {
+        pruner_.select_wheels(odometer, wheel_idx);
+        if (pruner_.odometer_sudoku_has_solution()) return false;
+        pruned_ += 1;
+        if (LEARN_NOGOODS) learn_nogood(pruner_, odometer, wheel_idx);
+        return true;
+    }
+
+    // Files a nogood from the first |n| wheels, which have no solution.
+    void learn_nogood(Workspace& workspace, const Odometer& odometer, int n) {
+        int wheels[81];
+        int k = workspace.find_nogood(odometer, n, wheels);
+        nogoods_.add(odometer, wheels, k);
+    }
+
+    // Whether a nogood rules out the values of wheels 0..wheel_idx.
+    bool is_ruled_out(const Odometer& odometer, int wheel_idx) {
+        if (!LEARN_NOGOODS || !nogoods_.rules_out(odometer, wheel_idx)) return false;
+        ruled_out_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Whether to go on once wheel |wheel_idx| is set: not if a nogood
+    // rules the odometer out, nor if a symmetry of the pattern maps it
+    // to an earlier one, which stands for it.
+    bool admits(const Odometer& odometer, int wheel_idx) {
+        if (is_ruled_out(odometer, wheel_idx)) return false;
+        if (symmetries_.may_be_least(odometer, wheel_idx+1)) return true;
+        symmetric_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
 
     size_t count_processed() {
         size_t count = 0;
@@ -92,24 +412,101 @@ struct Taskmaster : public RoundRobinPool<Workspace, Odometer, NUM_THREADS, Task
         return count;
     }
 
-    void process(Workspace& workspace, const Odometer& odometer) {
-        workspace.complete_odometer_sudoku(odometer);
-        int solution_count = workspace.count_solutions_to_odometer_sudoku();
-        if (solution_count == 1) {
-            std::lock_guard<std::mutex> lk(mtx_);
-            printf("This sudoku grid was a meta solution!\n");
-            int grid[9][9];
-            odometer_to_grid(odometer, grid);
-            print_sudoku_grid(grid);
-            printf("The unique solution to the sudoku grid above is:\n");
-            print_unique_sudoku_solution(grid);
-            int found = ++solutions_;
-            if (found >= 2) {
-                throw ConsumerShutDownException();
-            }
+#if DANCE_STATS
+    void print_search_stats() {
+        DanceStats stats;
+        this->for_each_state([&](const Workspace& workspace) {
+            stats.add(workspace.stats);
+        });
+        stats.print();
+    }
+#endif
+
+    void report_meta_solution(const Odometer& odometer, int solution[9][9]) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        printf("This sudoku grid was a meta solution!\n");
+        int grid[9][9];
+        odometer_to_grid(odometer, grid, solution);
+        print_sudoku_grid(grid);
+        printf("The unique solution to the sudoku grid above is:\n");
+        printf("-----\n");
+        print_sudoku_grid(solution);
+        // It stands for its whole orbit under the symmetries.
+        int orbit_size = symmetries_.orbit_size(odometer);
+        if (orbit_size > 1) {
+            printf("So are the %d grids symmetric to it.\n", orbit_size - 1);
+        }
+        int found = (solutions_ += orbit_size);
+        if (found >= 2) {
+            throw ConsumerShutDownException();
+        }
+    }
+
+    void process(Worker& worker, OdometerSubtree task) {
+        Workspace& workspace = worker;
+        Odometer& odometer = worker.odometer;
+        task.unpack_into(odometer);
+        if (COUNT_SUBTREES_IN_ONE_SEARCH) {
+            workspace.count_completions(odometer, task.wheel_idx, task.next_unseen_value,
+                                        [&](const Odometer& odometer, int wheel_idx) {
+                return admits(odometer, wheel_idx);
+            }, [&](const Odometer& odometer, int count) {
+                process_count(workspace, odometer, count, nullptr);
+                return false;
+            });
+        } else {
+            workspace.select_wheels(odometer, task.wheel_idx);
+            process_subtree(workspace, odometer, task.wheel_idx, task.next_unseen_value);
         }
         workspace.processed += 1;
     }
+
+    // Reports a candidate with one solution, which is recomputed if
+    // not given, and learns from one with none.
+    void process_count(Workspace& workspace, const Odometer& odometer, int count, int (*solution)[9]) {
+        if (count == 1) {
+            int grid[9][9] = {};
+            int found[1][9][9];
+            if (solution == nullptr) {
+                for (int i=0; i < odometer.num_wheels; ++i) {
+                    grid[odometer.wheels[i].idx / 9][odometer.wheels[i].idx % 9] = odometer.wheels[i].value;
+                }
+                find_sudoku_solutions(grid, found, 1);
+                solution = found[0];
+            }
+            report_meta_solution(odometer, solution);
+        } else if (count == 0 && LEARN_NOGOODS) {
+            learn_nogood(workspace, odometer, odometer.num_wheels);
+        }
+    }
+
+    // The same walk as count_solutions_with_odometer(), but checking
+    // each odometer as it goes.
+    void process_subtree(Workspace& workspace, Odometer& odometer, int wheel_idx, int next_unseen_value) {
+        if (wheel_idx == odometer.num_wheels) {
+            if (next_unseen_value >= 9) {
+                int solution[9][9];
+                int count = workspace.count_solutions_to_odometer_sudoku(solution);
+                process_count(workspace, odometer, count, solution);
+            }
+            return;
+        }
+        OdometerWheel *wheel = &odometer.wheels[wheel_idx];
+        uint32_t allowed = ~odometer.conflicting_values(wheel_idx) & ((1u << next_unseen_value) - 2);
+        for (; allowed != 0; allowed &= allowed - 1) {
+            int value = __builtin_ctz(allowed);
+            wheel->value = value;
+            if (!admits(odometer, wheel_idx)) continue;
+            workspace.set_wheel(odometer, wheel_idx);
+            process_subtree(workspace, odometer, wheel_idx+1, next_unseen_value);
+        }
+        if (next_unseen_value <= 9) {
+            wheel->value = next_unseen_value;
+            if (!admits(odometer, wheel_idx)) return;
+            workspace.set_wheel(odometer, wheel_idx);
+            process_subtree(workspace, odometer, wheel_idx+1, next_unseen_value+1);
+        }
+    }
 };
 
 template<int SHORT_CUT_FACTOR>
@@ -123,36 +520,50 @@ constexpr size_t pow9() {
 template<int SHORT_CUT_FACTOR>
 int count_solutions_with_odometer(Taskmaster& taskmaster, Odometer& odometer, int wheel_idx, int next_unseen_value)
 {
-    if (wheel_idx == odometer.num_wheels - SHORT_CUT_FACTOR) {
-        if (SHORT_CUT_FACTOR != 0 || next_unseen_value >= 9) {
+    int wheels_left = odometer.num_wheels - wheel_idx;
+    // Each wheel still to turn adds at most one new value, and a
+    // candidate must use at least eight of them.
+    if (next_unseen_value + wheels_left < 9) {
+        return 0;
+    }
+    if (wheel_idx > 0 && !taskmaster.admits(odometer, wheel_idx-1)) {
+        return 0;
+    }
+    if (PRUNE_DOWN_TO_WHEELS_LEFT != 0 && wheels_left >= PRUNE_DOWN_TO_WHEELS_LEFT &&
+            taskmaster.has_no_completion(odometer, wheel_idx)) {
+        return 0;
+    }
+
+    if (wheels_left == SHORT_CUT_FACTOR) {
 #if JUST_COUNT_VIABLE_GRIDS
-            count_of_viable_grids += pow9<SHORT_CUT_FACTOR>();
-            if ((count_of_viable_grids & 0xFFFF) == 0) {
-                printf("\rmeta %zu", count_of_viable_grids);
-            }
+        count_of_viable_grids += pow9<SHORT_CUT_FACTOR>();
+        if ((count_of_viable_grids & 0xFFFF) == 0) {
+            printf("\rmeta %zu", count_of_viable_grids);
+        }
 #else
-            static size_t counter = 0;
-            ++counter;
-            if ((counter & 0xFFFF) == 0) {
-                size_t processed = taskmaster.count_processed();
-                printf("\rmeta %zu (+%zu)", counter, counter - processed);
-                if ((counter - processed) > 1000000) {
-                    // Sleep and let the worker threads catch up.
-                    std::this_thread::sleep_for(std::chrono::seconds(1));
-                    printf("\rmeta %zu (+%zu)", counter, counter - taskmaster.count_processed());
-                }
-                fflush(stdout);
+        static size_t counter = 0;
+        ++counter;
+        if ((counter & 0xFFFF) == 0) {
+            size_t processed = taskmaster.count_processed();
+            printf("\rmeta %zu (+%zu)", counter, counter - processed);
+            if ((counter - processed) > 50000) {
+                // Sleep and let the worker threads catch up. (Each
+                // task is a subtree of dozens of odometers.)
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                printf("\rmeta %zu (+%zu)", counter, counter - taskmaster.count_processed());
             }
-            taskmaster.push(odometer);
-#endif
+            fflush(stdout);
         }
+        taskmaster.push(OdometerSubtree{odometer, wheel_idx, next_unseen_value});
+#endif
         return 0;
     }
 
     OdometerWheel *wheel = &odometer.wheels[wheel_idx];
     int result = 0;
-    for (int value = 1; value < next_unseen_value; ++value) {
-        if (has_prior_conflict(odometer, *wheel, value)) continue;
+    uint32_t allowed = ~odometer.conflicting_values(wheel_idx) & ((1u << next_unseen_value) - 2);
+    for (; allowed != 0; allowed &= allowed - 1) {
+        int value = __builtin_ctz(allowed);
         wheel->value = value;
         result += count_solutions_with_odometer<SHORT_CUT_FACTOR>(taskmaster, odometer, wheel_idx+1, next_unseen_value);
         if (result >= 2) {
@@ -169,15 +580,15 @@ int count_solutions_with_odometer(Taskmaster& taskmaster, Odometer& odometer, in
 
 bool metasudoku_has_exactly_one_solution(const int grid[9][9])
 {
+    Odometer odometer = odometer_from_grid(grid);
     Taskmaster taskmaster;
-    taskmaster.for_each_state([&](Workspace& workspace) {
-        workspace.begin_odometer_sudoku(grid);
-    });
+    taskmaster.symmetries_ = find_pattern_symmetries(odometer);
+    printf("the clue pattern has %d symmetries\n", taskmaster.symmetries_.group_order());
+    taskmaster.begin_odometer_sudoku(odometer);
     taskmaster.start_threads();
 
-    Odometer odometer = odometer_from_grid(grid);
     try {
-        count_solutions_with_odometer<0>(taskmaster, odometer, 0, 1);
+        count_solutions_with_odometer<WHEELS_PER_SUBTREE>(taskmaster, odometer, 0, 1);
     } catch (const ProducerShutDownException&) {
         puts("caught the short-circuit");
         taskmaster.shutdown_from_producer_side();
@@ -185,6 +596,18 @@ bool metasudoku_has_exactly_one_solution(const int grid[9][9])
 
     taskmaster.shutdown_when_empty();
     taskmaster.wait();
+#if DANCE_STATS
+    taskmaster.print_search_stats();
+#endif
+    size_t nodes = 0;
+    taskmaster.for_each_state([&](const Workspace& workspace) {
+        nodes += workspace.policy.nodes;
+    });
+    printf("searched %zu DLX nodes\n", nodes);
+    printf("pruned %zu subtrees\n", taskmaster.pruned_);
+    printf("ruled out %zu odometers and subtrees by %zu nogoods\n",
+           size_t(taskmaster.ruled_out_), taskmaster.nogoods_.size());
+    printf("skipped %zu odometers and subtrees as symmetric\n", size_t(taskmaster.symmetric_));
     int num_solutions = taskmaster.solutions_;
     printf("num_solutions is %d\n", num_solutions);
     return num_solutions == 1;
@@ -239,6 +662,104 @@ const int sudoku_example_gordon_royle_unique[9][9] = {
     {0,0,0,3,0,0,0,0,0},
 };
 
+// A clue pattern on the main diagonal is left as it is by the
+// transpose, which mustn't then count as a symmetry of its own: its
+// symmetries are just the 6**4 maps that move rows and columns alike.
+static bool symmetries_pass_self_test()
+{
+    int grid[9][9] = {};
+    for (int i = 0; i < 9; ++i) {
+        grid[i][i] = i + 1;
+    }
+    return find_pattern_symmetries(odometer_from_grid(grid)).group_order() == 1296;
+}
+
+// Counting more than two solutions goes through a DanceCountCache,
+// whose counts must agree with a plain search's, and must not carry
+// over from one matrix to another with the same columns. The 9x9 grid
+// is sudoku_example_17 without the 2 in row 6 (5051 solutions), but
+// the bitboard solver counts that one, if it's enabled.
+static bool count_cache_passes_self_test()
+{
+    auto count_all = [](const auto& grid) {
+        return enumerate_sudoku_solutions<2>(grid, INT_MAX, [](const int (*)[4]) { return false; });
+    };
+    static int grids[2][4][4] = {};
+    grids[1][0][0] = 1;
+    int counts[2];
+    count_sudoku_solutions_batch<2>(grids, 2, counts, 1000);
+    if (counts[0] != count_all(grids[0]) || counts[1] != count_all(grids[1])) {
+        return false;
+    }
+    count_sudoku_solutions_batch<2>(grids, 1, counts, 100);
+    if (counts[0] != 100) {
+        return false;
+    }
+
+    // The same columns, but without the rows that put anything but a
+    // 1 in the first cell.
+    static DanceMatrix full, restricted;
+    build_full_sudoku_matrix<2>(full);
+    restricted.init(SudokuShape<2>::num_columns);
+    int constraint[4];
+    for (int i = 0; i < 16; ++i) {
+        for (int value = 1; value <= 4; ++value) {
+            if (i == 0 && value != 1) continue;
+            SudokuShape<2>::get_constraint_columns(i / 4, i % 4, value, constraint);
+            restricted.addrow(4, constraint);
+        }
+    }
+    DanceCountCache cache(10);
+    if (full.count_solutions(1000, cache) != count_all(grids[0]) ||
+        restricted.count_solutions(1000, cache) != count_all(grids[1])) {
+        return false;
+    }
+
+    int grid[1][9][9];
+    memcpy(grid[0], sudoku_example_17, sizeof grid[0]);
+    grid[0][5][1] = 0;
+    count_sudoku_solutions_batch(grid, 1, counts, 10000);
+    return counts[0] == enumerate_sudoku_solutions(grid[0], 10000, [](const int (*)[9]) { return false; });
+}
+
+// A search run a few nodes at a time must count what solve() does,
+// and one given up part-way must leave the matrix as it found it:
+// here on the 5051 solutions of sudoku_example_17 without one clue.
+static bool resumable_search_passes_self_test()
+{
+    const auto& grid = sudoku_example_17;
+    Odometer odometer = odometer_from_grid(grid);
+    for (int i = 0; i < odometer.num_wheels; ++i) {
+        odometer.wheels[i].value = grid[odometer.wheels[i].idx / 9][odometer.wheels[i].idx % 9];
+    }
+    static Workspace workspace;
+    workspace.begin_odometer_sudoku();
+    workspace.select_clue_rows(odometer, odometer.num_wheels - 1);
+    DanceMatrix& mat = workspace.mat;
+    auto f = [](int, auto*) {
+        dance_result result;
+        result.count = 1;
+        result.short_circuit = false;
+        return result;
+    };
+    int expected = mat.solve(f);
+    MinimumRemainingValues policy;
+    mat.begin_search();
+    int chunks = 1;
+    while (!mat.resume_search(f, policy, 100)) {
+        chunks += 1;
+    }
+    if (chunks < 2 || mat.search_count() != expected) {
+        return false;
+    }
+    mat.begin_search();
+    for (int i = 0; i < 10; ++i) {
+        if (mat.resume_search(f, policy, 100)) return false;
+    }
+    mat.abandon_search();
+    return mat.num_selected_rows() == odometer.num_wheels - 1 && mat.solve(f) == expected;
+}
+
 int main()
 {
     if (count_sudoku_solutions(sudoku_example_newspaper) != 1) {
@@ -249,6 +770,14 @@ int main()
         puts("FAILED SELF TEST"); exit(1);
     } else if (count_sudoku_solutions(sudoku_example_gordon_royle_unique) != 1) {
         puts("FAILED SELF TEST"); exit(1);
+    } else if (count_sudoku_solutions_in_parallel(sudoku_example_17, NUM_THREADS) != 1) {
+        puts("FAILED PARALLEL SELF TEST"); exit(1);
+    } else if (!symmetries_pass_self_test()) {
+        puts("FAILED SYMMETRY SELF TEST"); exit(1);
+    } else if (!count_cache_passes_self_test()) {
+        puts("FAILED COUNT CACHE SELF TEST"); exit(1);
+    } else if (!resumable_search_passes_self_test()) {
+        puts("FAILED RESUMABLE SEARCH SELF TEST"); exit(1);
     }
 
     const auto& grid = sudoku_example_gordon_royle_unique;
@@ -256,12 +785,12 @@ int main()
 #if JUST_COUNT_VIABLE_GRIDS
     Taskmaster dummy;
     Odometer odometer = odometer_from_grid(grid);
+    dummy.begin_odometer_sudoku(odometer);
     count_of_viable_grids = 0;
     count_solutions_with_odometer<9>(dummy, odometer, 0, 1);
     printf("\nWith SHORT_CUT_FACTOR=9, the number of viable grids is <= %zu\n", count_of_viable_grids);
-    count_of_viable_grids = 0;
-    count_solutions_with_odometer<0>(dummy, odometer, 0, 1);
-    printf("\nThe number of viable grids is exactly %zu\n", count_of_viable_grids);
+    // Walking the whole odometer would take hours.
+    printf("The number of viable grids is exactly %zu\n", count_odometer_settings(odometer, 8));
 #else
     bool r = metasudoku_has_exactly_one_solution(grid);
     printf("metasudoku %s have exactly one solution\n", r ? "does" : "does not");
@@ -1,42 +1,250 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <type_traits>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "dance.h"
+#include "sudoku.h"
 
-struct OdometerWheel {
-    int idx = 0;  // refers to grid[idx/9][idx%9]
+template<int BoxSize>
+struct BasicOdometerWheel {
+    static constexpr int N = SudokuShape<BoxSize>::N;
+    static constexpr int max_conflicts = SudokuShape<BoxSize>::num_peers;
+
+    int idx = 0;  // refers to grid[idx/N][idx%N]
     int value = 0;
     int num_conflicts = 0;
-    std::array<int, 20> conflicts = {};
+    std::array<int, max_conflicts> conflicts = {};
 
-    constexpr OdometerWheel() = default;
-    constexpr explicit OdometerWheel(int i) : idx(i) {}
+    constexpr BasicOdometerWheel() = default;
+    constexpr explicit BasicOdometerWheel(int i) : idx(i) {}
 
     constexpr void add_conflict(int previous_wheel_number) {
-        assert(num_conflicts < 20);
+        assert(num_conflicts < max_conflicts);
         conflicts[num_conflicts++] = previous_wheel_number;
     }
 };
 
-struct Odometer {
-    std::array<OdometerWheel, 81> wheels;
+template<int BoxSize>
+struct BasicOdometer {
+    static constexpr int max_wheels = SudokuShape<BoxSize>::num_cells;
+
+    std::array<BasicOdometerWheel<BoxSize>, max_wheels> wheels;
     int num_wheels = 0;
 
-    constexpr void add_wheel(const OdometerWheel& new_wheel) {
-        assert(num_wheels < 81);
+    constexpr void add_wheel(const BasicOdometerWheel<BoxSize>& new_wheel) {
+        assert(num_wheels < max_wheels);
         wheels[num_wheels++] = new_wheel;
     }
 
-    constexpr Odometer() = default;
+    // Adds a wheel for cell |idx|, conflicting with every earlier
+    // wheel in the same row, column or box.
+    constexpr void add_wheel_for_cell(int idx) {
+        BasicOdometerWheel<BoxSize> new_wheel(idx);
+        for (int i=0; i < num_wheels; ++i) {
+            if (SudokuShape<BoxSize>::are_peers(wheels[i].idx, idx)) {
+                new_wheel.add_conflict(i);
+            }
+        }
+        add_wheel(new_wheel);
+    }
+
+    // The values of the earlier wheels that wheel |i| conflicts with,
+    // as a mask with bit v for value v: one pass over the conflicts
+    // for all the values the wheel might take.
+    constexpr uint32_t conflicting_values(int i) const {
+        const BasicOdometerWheel<BoxSize>& wheel = wheels[i];
+        uint32_t mask = 0;
+        for (int k=0; k < wheel.num_conflicts; ++k) {
+            mask |= uint32_t(1) << wheels[wheel.conflicts[k]].value;
+        }
+        return mask;
+    }
+
+    constexpr BasicOdometer() = default;
 };
 
-struct Workspace {
-    DanceMatrix mat;
-    DanceMatrix mat2;
+using OdometerWheel = BasicOdometerWheel<3>;
+using Odometer = BasicOdometer<3>;
+
+// Relabels values in order of first appearance, just as the odometer
+// labels its wheels: the first value given becomes 1, the next
+// different one 2, and so on. Relabeling a grid's values changes
+// nothing about its solutions, so candidates, nogoods and symmetric
+// images all compare this way.
+template<int BoxSize>
+class BasicRelabeling {
+public:
+    int operator()(int value) {
+        assert(value >= 1 && value <= SudokuShape<BoxSize>::N);
+        if (label_[value] == 0) label_[value] = next_label_++;
+        return label_[value];
+    }
+
+private:
+    int label_[SudokuShape<BoxSize>::N + 1] = {};
+    int next_label_ = 1;
+};
+
+using Relabeling = BasicRelabeling<3>;
+
+// Sudoku matrices number their columns row-value, column-value,
+// box-value, and then cell (see SudokuShape). This ranks the cell
+// columns first.
+template<int BoxSize>
+struct BasicSudokuCellColumnsFirst {
+    int operator()(int column) const { return 3 - column / SudokuShape<BoxSize>::num_cells; }
+};
+
+using SudokuCellColumnsFirst = BasicSudokuCellColumnsFirst<3>;
+
+// The column-selection policy for verifying candidate grids. Each
+// policy counts the search nodes it visits, so comparing them is a
+// one-line change here.
+using SudokuColumnPolicy = MinimumRemainingValues;
+
+// Sets of wheel values known to leave the grid with no solution.
+// A nogood records some wheels and their values, but only which of
+// those values are equal matters, since relabeling the values of a
+// grid doesn't change whether it has a solution; so it rules out any
+// odometer whose values in those wheels fall into the same pattern.
+// Nogoods are filed under their last wheel, to be checked as soon as
+// that wheel is set. Adding is locked, and checking isn't: each list
+// only grows, and publishes its new size after the new entry.
+template<int BoxSize>
+class BasicNogoodDatabase {
+    static constexpr int max_wheels = SudokuShape<BoxSize>::num_cells;
+    static constexpr int max_size = 16;  // bigger ones rule out too little
+    static constexpr int max_per_wheel = 256;
+
+    struct Nogood {
+        int size;
+        std::array<uint16_t, max_size> wheels;
+        std::array<unsigned char, max_size> labels;  // in order of first appearance
+    };
+    struct List {
+        std::atomic<int> size{0};
+        std::array<Nogood, max_per_wheel> nogoods;
+    };
+    std::array<List, max_wheels> lists_;
+    std::mutex mtx_;
+
+public:
+    // Files the values of |odometer|'s wheels wheels[0..n-1], which
+    // must be in increasing order.
+    void add(const BasicOdometer<BoxSize>& odometer, const int *wheels, int n) {
+        if (n == 0 || n > max_size) return;
+        std::lock_guard<std::mutex> lk(mtx_);
+        List& list = lists_[wheels[n-1]];
+        int k = list.size.load(std::memory_order_relaxed);
+        if (k == max_per_wheel) return;
+        Nogood& nogood = list.nogoods[k];
+        BasicRelabeling<BoxSize> relabel;
+        nogood.size = n;
+        for (int i=0; i < n; ++i) {
+            nogood.wheels[i] = wheels[i];
+            nogood.labels[i] = relabel(odometer.wheels[wheels[i]].value);
+        }
+        list.size.store(k+1, std::memory_order_release);
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const List& list : lists_) total += list.size.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // Whether some nogood whose last wheel is |wheel| matches the
+    // odometer's current values.
+    bool rules_out(const BasicOdometer<BoxSize>& odometer, int wheel) const {
+        const List& list = lists_[wheel];
+        int k = list.size.load(std::memory_order_acquire);
+        for (int j=0; j < k; ++j) {
+            const Nogood& nogood = list.nogoods[j];
+            BasicRelabeling<BoxSize> relabel;
+            bool matches = true;
+            for (int i=0; i < nogood.size && matches; ++i) {
+                matches = (relabel(odometer.wheels[nogood.wheels[i]].value) == nogood.labels[i]);
+            }
+            if (matches) return true;
+        }
+        return false;
+    }
+};
+
+// The number of ways to set the odometer's wheels, up to relabeling,
+// that use at least |min_values| different values: the proper
+// colorings of its conflict graph with N colors, up to permuting the
+// colors. This is what walking the whole odometer would count, but
+// found by dynamic programming over the wheels in order, remembering
+// only which of the wheels with conflicts still to come share values.
+template<int BoxSize>
+size_t count_odometer_settings(const BasicOdometer<BoxSize>& odometer, int min_values);
+
+// The 9x9 matrix fits the default DanceMatrix; up to 25x25 still
+// fits 16-bit node indices, but needs the storage to grow.
+template<int BoxSize>
+using SudokuDanceMatrix = typename std::conditional<(BoxSize <= 3), DanceMatrix,
+    BasicDanceMatrix<GrowableDanceStorage<uint16_t>>>::type;
+
+template<int BoxSize>
+struct BasicWorkspace {
+    static constexpr int N = SudokuShape<BoxSize>::N;
+
+    SudokuDanceMatrix<BoxSize> mat;
+    SudokuColumnPolicy policy;
+    DanceStats stats;  // filled in only if DANCE_STATS
+    int selected_values[N*N];  // the value of each wheel selected in mat
+    int clue_grid[N][N];  // used instead of mat by USE_BITBOARD_SOLVER, mostly
     size_t processed = 0;
 
-    void begin_odometer_sudoku(const int grid[9][9]);
-    void complete_odometer_sudoku(const Odometer& odometer);
-    int count_solutions_to_odometer_sudoku();
+    // Sets up for odometers over any clue pattern: the clues come
+    // from each odometer's wheels.
+    void begin_odometer_sudoku();
+    void complete_odometer_sudoku(const BasicOdometer<BoxSize>& odometer);
+    // For a worker that walks a subtree of odometers itself, so that
+    // each step costs one clue rather than all of them. select_wheels()
+    // makes the first |n| wheels the clues, keeping whatever it can of
+    // the previous ones; set_wheel() keeps wheels 0..i-1 and makes
+    // wheel i's current value a clue, forgetting any later wheels.
+    // Count only once every wheel has been set.
+    void select_wheels(const BasicOdometer<BoxSize>& odometer, int n);
+    void set_wheel(const BasicOdometer<BoxSize>& odometer, int i);
+    // Counts are capped at 2. Where given a place to put it, each
+    // count also comes with the first solution found, if any.
+    int count_solutions_to_odometer_sudoku(int (*solution)[N] = nullptr);
+    // Whether the clues so far have any solution at all. Unlike the
+    // counting, this allows for wheels not yet selected.
+    bool odometer_sudoku_has_solution();
+    void count_solutions_to_odometer_sudokus(const BasicOdometer<BoxSize> *odometers, int n, int *counts,
+                                             int (*solutions)[N][N] = nullptr);
+    // Counts, up to 2, the solutions of every completion of the first
+    // |n| wheels, in one search that branches on the other wheels'
+    // cells before any others; this replaces select_wheels() and a
+    // walk of set_wheel() and counting. Only completions the odometer
+    // would produce are counted, labeling new values from
+    // |next_unseen_value| on, and of those, only the ones |admit|
+    // lets through: admit(odometer, i) is asked as soon as wheel i
+    // has its value. |f| gets the odometer with each completion's
+    // values in place, and its count, and returns true to stop.
+    void count_completions(BasicOdometer<BoxSize>& odometer, int n, int next_unseen_value,
+                           const std::function<bool(const BasicOdometer<BoxSize>&, int)>& admit,
+                           const std::function<bool(const BasicOdometer<BoxSize>&, int)>& f);
+    // Given that the first |n| wheels' clues have no solution, shrinks
+    // them to a set that still has none, dropping one wheel at a time
+    // (latest first) while that holds. The survivors go in |wheels|,
+    // in increasing order; returns how many there are.
+    int find_nogood(const BasicOdometer<BoxSize>& odometer, int n, int *wheels);
+
+    // select_wheels() and set_wheel() for mat, whichever the backend.
+    void select_clue_rows(const BasicOdometer<BoxSize>& odometer, int n);
+    void select_clue_row(const BasicOdometer<BoxSize>& odometer, int i);
 };
 
+using Workspace = BasicWorkspace<3>;
@@ -1,174 +1,780 @@
 
 #include "sudoku.h"
 
+#include <map>
+#include <vector>
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include "bit-sudoku.h"
 #include "dance.h"
 #include "odo-sudoku.h"
 
-void Workspace::begin_odometer_sudoku(const int grid[9][9])
+// In a matrix from build_full_sudoku_matrix(), row r puts the value
+// N - r%N in cell r/N, so a solution decodes without looking at its
+// columns at all.
+template<int BoxSize, class Matrix>
+static void decode_full_sudoku_solution(const Matrix& mat, int n, const typename Matrix::node_t *sol,
+                                        int (*grid)[BoxSize*BoxSize])
 {
-    int ncols = 9*(9+9+9)+81;
-    mat.init(ncols);
+    constexpr int N = BoxSize * BoxSize;
+    for (int i = 0; i < n; ++i) {
+        int r = mat.row_number(sol[i]);
+        grid[r / (N*N)][(r / N) % N] = N - r % N;
+    }
+}
 
-    int nrows = 0;
-    int constraint[4];
-    for (int i = 0; i < 81; ++i) {
-        int row = i / 9;
-        int col = i % 9;
-        int box = (row/3)*3 + (col/3);
-        int value = grid[row][col];
-        if (value != 0) continue;
-        for (int value = 9; value >= 1; --value) {
-            constraint[0] = 9*row + value-1;
-            constraint[1] = 81 + 9*col + value-1;
-            constraint[2] = 162 + 9*box + value-1;
-            constraint[3] = 243 + (9*row+col);
-            mat.addrow(4, constraint);
+// The candidates for each cell as a bitmask, with bit v-1 for value
+// v, narrowed by logic alone: naked singles, hidden singles, and
+// locked candidates (pointing and claiming). Most grids without a
+// solution fall to this before any search, and the rest come out
+// with far fewer candidates to put in a matrix.
+template<int BoxSize>
+class SudokuCandidates {
+    using Shape = SudokuShape<BoxSize>;
+    static constexpr int N = Shape::N;
+public:
+    using mask_t = uint32_t;
+    static constexpr mask_t all_values = mask_t(-1) >> (32 - N);
+
+    // These return false on finding a contradiction.
+    bool init(const int grid[][N]);
+    bool propagate();
+
+    mask_t candidates(int i) const { return cell_[i]; }
+
+private:
+    struct Tables {
+        int unit[3*N][N];  // N rows, N columns, N boxes
+        int peers[Shape::num_cells][Shape::num_peers];
+        Tables();
+    };
+    static const Tables& tables() {
+        static const Tables t;
+        return t;
+    }
+
+    bool place(int i, mask_t bit);
+    bool eliminate(int i, mask_t bits, bool *progress);
+    bool find_hidden_singles(bool *progress);
+    bool find_locked_candidates(bool *progress);
+
+    mask_t cell_[Shape::num_cells];
+    bool placed_[Shape::num_cells];
+};
+
+template<int BoxSize>
+SudokuCandidates<BoxSize>::Tables::Tables()
+{
+    for (int r = 0; r < N; ++r) {
+        for (int c = 0; c < N; ++c) {
+            unit[r][c] = N*r + c;
+            unit[N + c][r] = N*r + c;
+            int b = Shape::box_of(r, c);
+            unit[2*N + b][(r % BoxSize) * BoxSize + (c % BoxSize)] = N*r + c;
         }
-        nrows += 9;
     }
-    mat.nrows_ = nrows;
-    mat2 = mat;
+    for (int i = 0; i < Shape::num_cells; ++i) {
+        int n = 0;
+        for (int j = 0; j < Shape::num_cells; ++j) {
+            if (j != i && Shape::are_peers(i, j)) peers[i][n++] = j;
+        }
+        assert(n == Shape::num_peers);
+    }
 }
 
-void Workspace::complete_odometer_sudoku(const Odometer& odometer)
+template<int BoxSize>
+bool SudokuCandidates<BoxSize>::init(const int grid[][N])
 {
-    mat = mat2;
+    for (int i = 0; i < Shape::num_cells; ++i) {
+        cell_[i] = all_values;
+        placed_[i] = false;
+    }
+    for (int i = 0; i < Shape::num_cells; ++i) {
+        int value = grid[i / N][i % N];
+        if (value == 0) continue;
+        mask_t bit = mask_t(1) << (value - 1);
+        if (!(cell_[i] & bit) || !place(i, bit)) return false;
+    }
+    return true;
+}
 
-    int constraint[4];
-    for (int i = 0; i < odometer.num_wheels; ++i) {
-        const OdometerWheel& wheel = odometer.wheels[i];
-        int row = wheel.idx / 9;
-        int col = wheel.idx % 9;
-        int box = (row/3)*3 + (col/3);
-        int value = wheel.value;
-        constraint[0] = 9*row + value-1;
-        constraint[1] = 81 + 9*col + value-1;
-        constraint[2] = 162 + 9*box + value-1;
-        constraint[3] = 243 + (9*row+col);
-        mat.addrow(4, constraint);
+template<int BoxSize>
+bool SudokuCandidates<BoxSize>::place(int i, mask_t bit)
+{
+    cell_[i] = bit;
+    placed_[i] = true;
+    for (int p : tables().peers[i]) {
+        cell_[p] &= ~bit;
+        if (cell_[p] == 0) return false;
+    }
+    return true;
+}
+
+template<int BoxSize>
+bool SudokuCandidates<BoxSize>::eliminate(int i, mask_t bits, bool *progress)
+{
+    if (cell_[i] & bits) {
+        cell_[i] &= ~bits;
+        *progress = true;
+    }
+    return (cell_[i] != 0);
+}
+
+template<int BoxSize>
+bool SudokuCandidates<BoxSize>::find_hidden_singles(bool *progress)
+{
+    for (const auto& unit : tables().unit) {
+        mask_t once = 0;
+        mask_t twice = 0;
+        for (int i : unit) {
+            twice |= once & cell_[i];
+            once |= cell_[i];
+        }
+        if (once != all_values) return false;  // some value has nowhere to go
+        for (mask_t hidden = once & ~twice; hidden != 0; hidden &= hidden - 1) {
+            mask_t bit = hidden & -hidden;
+            int i = 0;
+            while (i < N && !(cell_[unit[i]] & bit)) ++i;
+            if (i == N) return false;  // another single in this unit took its cell
+            if (cell_[unit[i]] != bit) {
+                cell_[unit[i]] = bit;
+                *progress = true;
+            }
+        }
+    }
+    return true;
+}
+
+template<int BoxSize>
+bool SudokuCandidates<BoxSize>::find_locked_candidates(bool *progress)
+{
+    // Where a row (or column) crosses a box, a value that the rest of
+    // the box rules out must go in the crossing, and so nowhere else
+    // in the row; and the same with box and row swapped.
+    for (int b = 0; b < N; ++b) {
+        int top = (b / BoxSize) * BoxSize;
+        int left = (b % BoxSize) * BoxSize;
+        for (int k = 0; k < BoxSize; ++k) {
+            for (int by_column = 0; by_column < 2; ++by_column) {
+                // Cell (j, m) is the m'th cell of line j.
+                auto cell = [&](int j, int m) { return by_column ? N*m + j : N*j + m; };
+                int line = by_column ? left + k : top + k;
+                int first = by_column ? top : left;
+                mask_t crossing = 0;
+                mask_t rest_of_line = 0;
+                mask_t rest_of_box = 0;
+                for (int m = 0; m < N; ++m) {
+                    mask_t x = cell_[cell(line, m)];
+                    if (m >= first && m < first + BoxSize) {
+                        crossing |= x;
+                    } else {
+                        rest_of_line |= x;
+                    }
+                }
+                for (int j = 0; j < BoxSize; ++j) {
+                    if (j == k) continue;
+                    int other = (by_column ? left : top) + j;
+                    for (int m = first; m < first + BoxSize; ++m) {
+                        rest_of_box |= cell_[cell(other, m)];
+                    }
+                }
+                mask_t pointing = crossing & ~rest_of_box;
+                mask_t claiming = crossing & ~rest_of_line;
+                if ((pointing & rest_of_line) != 0) {
+                    for (int m = 0; m < N; ++m) {
+                        if (m >= first && m < first + BoxSize) continue;
+                        if (!eliminate(cell(line, m), pointing, progress)) return false;
+                    }
+                }
+                if ((claiming & rest_of_box) != 0) {
+                    for (int j = 0; j < BoxSize; ++j) {
+                        if (j == k) continue;
+                        int other = (by_column ? left : top) + j;
+                        for (int m = first; m < first + BoxSize; ++m) {
+                            if (!eliminate(cell(other, m), claiming, progress)) return false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+template<int BoxSize>
+bool SudokuCandidates<BoxSize>::propagate()
+{
+    // Apply the cheapest rule that makes progress, then start over.
+    while (true) {
+        bool progress = false;
+        for (int i = 0; i < Shape::num_cells; ++i) {
+            mask_t x = cell_[i];
+            if (!placed_[i] && (x & (x - 1)) == 0) {
+                if (!place(i, x)) return false;
+                progress = true;
+            }
+        }
+        if (progress) continue;
+        if (!find_hidden_singles(&progress)) return false;
+        if (progress) continue;
+        if (!find_locked_candidates(&progress)) return false;
+        if (!progress) return true;
     }
-    mat.nrows_ += odometer.num_wheels;
 }
 
-int Workspace::count_solutions_to_odometer_sudoku()
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::begin_odometer_sudoku()
+{
+    build_full_sudoku_matrix<BoxSize>(mat);
+    mat.set_stats(&stats);
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::complete_odometer_sudoku(const BasicOdometer<BoxSize>& odometer)
+{
+    select_wheels(odometer, odometer.num_wheels);
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::select_wheels(const BasicOdometer<BoxSize>& odometer, int n)
+{
+    select_clue_rows(odometer, n);
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::set_wheel(const BasicOdometer<BoxSize>& odometer, int i)
+{
+    select_clue_row(odometer, i);
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::select_clue_rows(const BasicOdometer<BoxSize>& odometer, int n)
+{
+    // Consecutive odometers usually differ only in their last few
+    // wheels. Keep the clues we share with the previous odometer
+    // selected, undo the rest, and then select our own.
+    int first_changed = 0;
+    while (first_changed < mat.num_selected_rows() && first_changed < n &&
+           selected_values[first_changed] == odometer.wheels[first_changed].value) {
+        first_changed += 1;
+    }
+    for (int i = first_changed; i < n; ++i) {
+        select_clue_row(odometer, i);
+    }
+    while (mat.num_selected_rows() > n) {
+        mat.deselect_row();
+    }
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::select_clue_row(const BasicOdometer<BoxSize>& odometer, int i)
+{
+    while (mat.num_selected_rows() > i) {
+        mat.deselect_row();
+    }
+    assert(mat.num_selected_rows() == i);
+
+    int constraint[4];
+    const BasicOdometerWheel<BoxSize>& wheel = odometer.wheels[i];
+    SudokuShape<BoxSize>::get_constraint_columns(wheel.idx / N, wheel.idx % N, wheel.value, constraint);
+    bool ok = mat.select_row(4, constraint);
+    assert(ok && "the odometer never produces conflicting clues");
+    (void)ok;
+    selected_values[i] = wheel.value;
+}
+
+template<int BoxSize>
+int BasicWorkspace<BoxSize>::count_solutions_to_odometer_sudoku(int (*solution)[N])
 {
-    auto f = [count = 0](int, auto**) mutable {
+    auto f = [&, count = 0](int n, auto *sol) mutable {
+        if (count == 0 && solution != nullptr) {
+            decode_full_sudoku_solution<BoxSize>(mat, n, sol, solution);
+        }
         dance_result result;
         result.count = 1;
         result.short_circuit = (++count >= 2);
         return result;
     };
-    return mat.solve<81>(std::ref(f));
+    return mat.template solve<N*N>(std::ref(f), policy);
+}
+
+template<int BoxSize>
+bool BasicWorkspace<BoxSize>::odometer_sudoku_has_solution()
+{
+    auto f = [](int, auto *) {
+        dance_result result;
+        result.count = 1;
+        result.short_circuit = true;
+        return result;
+    };
+    return mat.template solve<N*N>(f, policy) != 0;
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::count_solutions_to_odometer_sudokus(const BasicOdometer<BoxSize> *odometers, int n, int *counts,
+                                                                  int (*solutions)[N][N])
+{
+    for (int i = 0; i < n; ++i) {
+        complete_odometer_sudoku(odometers[i]);
+        counts[i] = count_solutions_to_odometer_sudoku((solutions != nullptr) ? solutions[i] : nullptr);
+    }
+}
+
+template<int BoxSize>
+void BasicWorkspace<BoxSize>::count_completions(BasicOdometer<BoxSize>& odometer, int n, int next_unseen_value,
+                                                const std::function<bool(const BasicOdometer<BoxSize>&, int)>& admit,
+                                                const std::function<bool(const BasicOdometer<BoxSize>&, int)>& f)
+{
+    // This always searches the matrix, even for the bitboard backend;
+    // the other wheels' cell columns are the ones to branch on, and
+    // their rows give the wheels' values (see build_full_sudoku_matrix).
+    select_clue_rows(odometer, n);
+    int k = odometer.num_wheels - n;
+    int columns[N*N];
+    int next_unseen[N*N + 1];  // before each of those wheels
+    for (int i = 0; i < k; ++i) {
+        columns[i] = 3*N*N + odometer.wheels[n+i].idx;
+    }
+    next_unseen[0] = next_unseen_value;
+    auto accept = [&](int i, const int *rows) {
+        int value = N - rows[i] % N;
+        if (value > next_unseen[i]) return false;
+        next_unseen[i+1] = next_unseen[i] + (value == next_unseen[i]);
+        // As in the odometer: each wheel left adds at most one new
+        // value, and a candidate must use at least N-1 of them.
+        if (next_unseen[i+1] + (k - i - 1) < N) return false;
+        odometer.wheels[n+i].value = value;
+        return admit(odometer, n+i);
+    };
+    auto g = [&](const int *, int count) {
+        return f(odometer, count);
+    };
+    mat.count_solutions_by_rows(k, columns, 2, accept, g, policy);
+}
+
+template<int BoxSize>
+int BasicWorkspace<BoxSize>::find_nogood(const BasicOdometer<BoxSize>& odometer, int n, int *wheels)
+{
+    // This works the same for either backend, and leaves our own state
+    // alone, since count_sudoku_solutions() has its own matrix.
+    int grid[N][N] = {};
+    for (int i = 0; i < n; ++i) {
+        const BasicOdometerWheel<BoxSize>& wheel = odometer.wheels[i];
+        grid[wheel.idx / N][wheel.idx % N] = wheel.value;
+    }
+    int k = 0;
+    for (int i = n - 1; i >= 0; --i) {
+        const BasicOdometerWheel<BoxSize>& wheel = odometer.wheels[i];
+        grid[wheel.idx / N][wheel.idx % N] = 0;
+        if (count_sudoku_solutions<BoxSize>(grid) != 0) {
+            grid[wheel.idx / N][wheel.idx % N] = wheel.value;
+            wheels[k++] = i;
+        }
+    }
+    std::reverse(wheels, wheels + k);
+    return k;
+}
+
+#if USE_BITBOARD_SOLVER
+
+// The bitboard solver only knows 9x9, so the 9x9 workspace swaps
+// its matrix for a plain clue grid, except in count_completions().
+
+template<>
+void BasicWorkspace<3>::begin_odometer_sudoku()
+{
+    memset(clue_grid, '\0', sizeof clue_grid);
+    build_full_sudoku_matrix<3>(mat);
+    mat.set_stats(&stats);
+}
+
+template<>
+void BasicWorkspace<3>::set_wheel(const Odometer& odometer, int i)
+{
+    const OdometerWheel& wheel = odometer.wheels[i];
+    clue_grid[wheel.idx / 9][wheel.idx % 9] = wheel.value;
+}
+
+// set_wheel() leaves the cells of any later wheels with their old
+// values until those wheels are set again, which is fine for counting
+// only complete odometers; select_wheels() clears them.
+template<>
+void BasicWorkspace<3>::select_wheels(const Odometer& odometer, int n)
+{
+    for (int i = 0; i < odometer.num_wheels; ++i) {
+        const OdometerWheel& wheel = odometer.wheels[i];
+        clue_grid[wheel.idx / 9][wheel.idx % 9] = (i < n) ? wheel.value : 0;
+    }
+}
+
+template<>
+int BasicWorkspace<3>::count_solutions_to_odometer_sudoku(int (*solution)[9])
+{
+    return bitboard_count_sudoku_solutions(clue_grid, 2, solution);
+}
+
+template<>
+bool BasicWorkspace<3>::odometer_sudoku_has_solution()
+{
+    return bitboard_count_sudoku_solutions(clue_grid, 1) != 0;
+}
+
+template<>
+void BasicWorkspace<3>::count_solutions_to_odometer_sudokus(const Odometer *odometers, int n, int *counts,
+                                                            int (*solutions)[9][9])
+{
+    // All these odometers share our clue pattern, which is exactly
+    // the case the lockstep solver is good at.
+    int grids[16][9][9];
+    for (int i = 0; i < n; i += 16) {
+        int m = (n - i < 16) ? (n - i) : 16;
+        for (int k = 0; k < m; ++k) {
+            complete_odometer_sudoku(odometers[i+k]);
+            memcpy(grids[k], clue_grid, sizeof clue_grid);
+        }
+        bitboard_count_sudoku_solutions_lockstep(grids, m, 2, counts + i,
+                                                 (solutions != nullptr) ? solutions + i : nullptr);
+    }
+}
+
+#endif // USE_BITBOARD_SOLVER
+
+template<int BoxSize>
+size_t count_odometer_settings(const BasicOdometer<BoxSize>& odometer, int min_values)
+{
+    constexpr int N = SudokuShape<BoxSize>::N;
+    // A wheel stays on the frontier from when it's set until the last
+    // wheel it conflicts with is. A state is the frontier wheels'
+    // values, relabeled in order of appearance, followed by how many
+    // values have been used so far; values used only off the frontier
+    // are all alike to the wheels still to come.
+    std::vector<int> last_conflict(odometer.num_wheels);
+    for (int i = 0; i < odometer.num_wheels; ++i) {
+        last_conflict[i] = i;
+        for (int k = 0; k < odometer.wheels[i].num_conflicts; ++k) {
+            last_conflict[odometer.wheels[i].conflicts[k]] = i;
+        }
+    }
+    using State = std::vector<unsigned char>;
+    std::vector<int> frontier;
+    std::map<State, size_t> states = {{State{0}, 1}};
+    for (int i = 0; i < odometer.num_wheels; ++i) {
+        const BasicOdometerWheel<BoxSize>& wheel = odometer.wheels[i];
+        std::vector<int> conflicting;  // places on the frontier
+        for (int k = 0; k < wheel.num_conflicts; ++k) {
+            int p = std::find(frontier.begin(), frontier.end(), wheel.conflicts[k]) - frontier.begin();
+            conflicting.push_back(p);
+        }
+        std::vector<int> kept;  // places on the frontier that stay on
+        for (int p = 0; p < (int)frontier.size(); ++p) {
+            if (last_conflict[frontier[p]] > i) kept.push_back(p);
+        }
+        std::map<State, size_t> next_states;
+        auto add = [&](const State& state, int value, int used, size_t ways) {
+            State next;
+            BasicRelabeling<BoxSize> relabel;
+            auto push = [&](int v) {
+                next.push_back(relabel(v));
+            };
+            for (int p : kept) push(state[p]);
+            if (last_conflict[i] > i) push(value);
+            next.push_back(used);
+            next_states[next] += ways;
+        };
+        for (const auto& entry : states) {
+            const State& state = entry.first;
+            size_t ways = entry.second;
+            int used = state.back();
+            int blocks = frontier.empty() ? 0 : *std::max_element(state.begin(), state.end() - 1);
+            bool taken[N+2] = {};
+            for (int p : conflicting) taken[state[p]] = true;
+            // The same value as some frontier wheels,
+            for (int v = 1; v <= blocks; ++v) {
+                if (!taken[v]) add(state, v, used, ways);
+            }
+            // or a used value that's off the frontier,
+            if (used > blocks) add(state, blocks+1, used, ways * (used - blocks));
+            // or a new one.
+            if (used < N) add(state, blocks+1, used+1, ways);
+        }
+        std::vector<int> next_frontier;
+        for (int p : kept) next_frontier.push_back(frontier[p]);
+        if (last_conflict[i] > i) next_frontier.push_back(i);
+        frontier.swap(next_frontier);
+        states.swap(next_states);
+    }
+    size_t total = 0;
+    for (const auto& entry : states) {
+        if (entry.first.back() >= min_values) total += entry.second;
+    }
+    return total;
 }
 
-template<class F>
-static int solve_sudoku_with_callback(const int grid[9][9], const F& f)
+template struct BasicWorkspace<2>;
+template struct BasicWorkspace<3>;
+template struct BasicWorkspace<4>;
+template struct BasicWorkspace<5>;
+template size_t count_odometer_settings<2>(const BasicOdometer<2>& odometer, int min_values);
+template size_t count_odometer_settings<3>(const BasicOdometer<3>& odometer, int min_values);
+template size_t count_odometer_settings<4>(const BasicOdometer<4>& odometer, int min_values);
+template size_t count_odometer_settings<5>(const BasicOdometer<5>& odometer, int min_values);
+
+// Returns false, leaving |mat| unusable, if the grid is seen to have
+// no solutions before any search.
+template<int BoxSize, class Matrix>
+static bool build_sudoku_matrix(Matrix& mat, const int grid[][BoxSize*BoxSize])
 {
+    using Shape = SudokuShape<BoxSize>;
+    constexpr int N = Shape::N;
     int constraint[4];
-    int ncols = 9*(9+9+9)+81;
     /*
-       1 in the first row; 2 in the first row;... 9 in the first row;
-       1 in the second row;... 9 in the ninth row;
+       1 in the first row; 2 in the first row;... N in the first row;
+       1 in the second row;... N in the Nth row;
        1 in the first column; 2 in the first column;...
-       1 in the first box; 2 in the first box;... 9 in the ninth box;
-       Something in (1,1); Something in (1,2);... Something in (9,9)
+       1 in the first box; 2 in the first box;... N in the Nth box;
+       Something in (1,1); Something in (1,2);... Something in (N,N)
     */
     int nrows = 0;
 
-    DanceMatrix mat;
-    mat.init(ncols);
+    SudokuCandidates<BoxSize> candidates;
+    if (!candidates.init(grid) || !candidates.propagate()) {
+        return false;
+    }
+
+    mat.init(Shape::num_columns);
 
     /*
        Input the grid, square by square. Each possibility for
        a single number in a single square gives us a row of the
-       matrix with exactly four entries in it.
+       matrix with exactly four entries in it. Cells that logic
+       has already settled get just the one row.
     */
-    for (int j=0; j < 9; ++j) {
-        int seen_this_row[9] = {0};
-        for (int i=0; i < 9; ++i) {
-            int box = (j/3)*3 + (i/3);
-            if (grid[j][i] != 0) {
-                constraint[0] = 9*j + grid[j][i]-1;
-                constraint[1] = 81 + 9*i + grid[j][i]-1;
-                constraint[2] = 162 + 9*box + grid[j][i]-1;
-                constraint[3] = 243 + (9*j+i);
-                mat.addrow(4, constraint);
-                ++nrows;
-                seen_this_row[grid[j][i]-1] = 1;
-            }
-            else {
-                for (int k=0; k < 9; ++k) {
-                    if (seen_this_row[k]) continue;
-                    constraint[0] = 9*j + k;
-                    constraint[1] = 81 + 9*i + k;
-                    constraint[2] = 162 + 9*box + k;
-                    constraint[3] = 243 + (9*j+i);
-                    mat.addrow(4, constraint);
-                    ++nrows;
-                }
-            }
+    for (int i=0; i < Shape::num_cells; ++i) {
+        auto x = candidates.candidates(i);
+        for (int k=0; k < N; ++k) {
+            if (!(x & (1u << k))) continue;
+            Shape::get_constraint_columns(i / N, i % N, k+1, constraint);
+            mat.addrow(4, constraint);
+            ++nrows;
         }
     }
     mat.nrows_ = nrows;
-    return mat.solve<81>(f);
+    return true;
 }
 
-int count_sudoku_solutions(const int grid[9][9])
+template<int BoxSize>
+static int dance_count_sudoku_solutions(const int grid[][BoxSize*BoxSize])
 {
-    auto f = [count = 0](int, auto**) mutable {
+    auto f = [count = 0](int, auto*) mutable {
         dance_result result;
         result.count = 1;
         result.short_circuit = (++count >= 2);
         return result;
     };
-    return solve_sudoku_with_callback(grid, std::ref(f));
+    SudokuDanceMatrix<BoxSize> mat;
+    if (!build_sudoku_matrix<BoxSize>(mat, grid)) return 0;
+    return mat.template solve<BoxSize*BoxSize*BoxSize*BoxSize>(std::ref(f));
 }
 
-void print_sudoku_grid(const int grid[9][9])
+template<int BoxSize>
+int count_sudoku_solutions(const int grid[][BoxSize*BoxSize])
 {
-    for (int j=0; j < 9; ++j) {
-        printf("   ");
-        for (int i=0; i < 9; ++i)
-          printf(" %d", grid[j][i]);
-        printf("\n");
+    return dance_count_sudoku_solutions<BoxSize>(grid);
+}
+
+template<>
+int count_sudoku_solutions<3>(const int grid[][9])
+{
+#if USE_BITBOARD_SOLVER
+    return bitboard_count_sudoku_solutions(grid, 2);
+#else
+    return dance_count_sudoku_solutions<3>(grid);
+#endif
+}
+
+// Each thread keeps one full matrix per box size for the functions
+// below, which select a grid's clues, search, and deselect them again.
+template<int BoxSize>
+static SudokuDanceMatrix<BoxSize>& thread_local_full_sudoku_matrix()
+{
+    thread_local SudokuDanceMatrix<BoxSize> mat;
+    thread_local bool built = false;
+    if (!built) {
+        build_full_sudoku_matrix<BoxSize>(mat);
+        built = true;
     }
+    return mat;
 }
 
-static dance_result print_unique_sudoku_result(int n, struct data_object **sol)
+// Returns false if some clue clashes with an earlier one. Either way,
+// the caller must deselect_all_rows() afterward.
+template<int BoxSize, class Matrix>
+static bool select_clue_rows(Matrix& mat, const int grid[][BoxSize*BoxSize])
 {
-    int grid[9][9];
+    using Shape = SudokuShape<BoxSize>;
+    constexpr int N = Shape::N;
+    int constraint[4];
+    for (int i = 0; i < Shape::num_cells; ++i) {
+        int value = grid[i / N][i % N];
+        if (value == 0) continue;
+        Shape::get_constraint_columns(i / N, i % N, value, constraint);
+        if (!mat.select_row(4, constraint)) return false;
+    }
+    return true;
+}
 
-    for (int i=0; i < n; ++i) {
-        int constraint[4];
-        int row, col, val;
-        row = col = val = 0;  /* shut up "unused" warning from compiler */
-        constraint[0] = sol[i]->left->column->name;
-        constraint[1] = sol[i]->column->name;
-        constraint[2] = sol[i]->right->column->name;
-        constraint[3] = sol[i]->right->right->column->name;
-        for (int j=0; j < 4; ++j) {
-            if (constraint[j] < 81) {
-                row = constraint[j] / 9;
-                val = constraint[j] % 9 + 1;
-            }
-            else if (constraint[j] < 162) {
-                col = (constraint[j]-81) / 9;
-            }
+template<class Matrix>
+static void deselect_all_rows(Matrix& mat)
+{
+    while (mat.num_selected_rows() > 0) {
+        mat.deselect_row();
+    }
+}
+
+template<int BoxSize>
+static void dance_count_sudoku_solutions_batch(const int (*grids)[BoxSize*BoxSize][BoxSize*BoxSize],
+                                               size_t n, int *counts, int limit)
+{
+    auto& mat = thread_local_full_sudoku_matrix<BoxSize>();
+    int count = 0;
+    auto f = [&count, limit](int, auto*) {
+        dance_result result;
+        result.count = 1;
+        result.short_circuit = (++count >= limit);
+        return result;
+    };
+    // Counting many solutions revisits the same subproblems over and
+    // over, so there it pays to memoise their counts. Merely telling
+    // one solution from two, it's all overhead. For 9x9, 2**16 slots
+    // (about 4 MB) counted sudoku_example_17 less its last clue the
+    // fastest, in 1.3s, against 1.8s with 2**20 and 3.1s with none.
+    thread_local DanceCountCache cache(16);
+    for (size_t g = 0; g < n; ++g) {
+        count = 0;
+        bool consistent = select_clue_rows<BoxSize>(mat, grids[g]);
+        if (!consistent) {
+            counts[g] = 0;
+        } else if (limit > 2) {
+            counts[g] = mat.count_solutions(limit, cache);
+        } else {
+            counts[g] = mat.template solve<SudokuShape<BoxSize>::num_cells>(std::ref(f));
         }
-        grid[row][col] = val;
+        deselect_all_rows(mat);
+    }
+}
+
+template<int BoxSize>
+void count_sudoku_solutions_batch(const int (*grids)[BoxSize*BoxSize][BoxSize*BoxSize],
+                                  size_t n, int *counts, int limit)
+{
+    dance_count_sudoku_solutions_batch<BoxSize>(grids, n, counts, limit);
+}
+
+template<>
+void count_sudoku_solutions_batch<3>(const int (*grids)[9][9], size_t n, int *counts, int limit)
+{
+#if USE_BITBOARD_SOLVER
+    // The bitboard solver has no setup cost worth amortizing.
+    for (size_t g = 0; g < n; ++g) {
+        counts[g] = bitboard_count_sudoku_solutions(grids[g], limit);
+    }
+#else
+    dance_count_sudoku_solutions_batch<3>(grids, n, counts, limit);
+#endif
+}
+
+template<int BoxSize>
+int count_sudoku_solutions_in_parallel(const int grid[][BoxSize*BoxSize], int nthreads)
+{
+    std::atomic<int> count{0};
+    auto f = [&count](int, auto*) {
+        dance_result result;
+        result.count = 1;
+        result.short_circuit = (++count >= 2);
+        return result;
+    };
+    SudokuDanceMatrix<BoxSize> mat;
+    if (!build_sudoku_matrix<BoxSize>(mat, grid)) return 0;
+    int n = mat.solve_in_parallel(f, nthreads);
+    return (n < 2) ? n : 2;
+}
+
+template<int BoxSize>
+void print_sudoku_grid(const int grid[][BoxSize*BoxSize])
+{
+    constexpr int N = BoxSize * BoxSize;
+    constexpr int width = (N < 10) ? 1 : 2;
+    for (int j=0; j < N; ++j) {
+        printf("   ");
+        for (int i=0; i < N; ++i)
+          printf(" %*d", width, grid[j][i]);
+        printf("\n");
     }
+}
 
-    printf("-----\n");
-    print_sudoku_grid(grid);
+template<int BoxSize>
+int enumerate_sudoku_solutions(const int grid[][BoxSize*BoxSize], int limit,
+                               const std::function<bool(const int (*)[BoxSize*BoxSize])>& f)
+{
+    constexpr int N = BoxSize * BoxSize;
+    auto& mat = thread_local_full_sudoku_matrix<BoxSize>();
+    int count = 0;
+    auto g = [&](int n, auto *sol) {
+        int solution[N][N];
+        decode_full_sudoku_solution<BoxSize>(mat, n, sol, solution);
+        count += 1;
+        dance_result result;
+        result.count = 1;
+        result.short_circuit = f(solution) || (count >= limit);
+        return result;
+    };
+    if (limit > 0 && select_clue_rows<BoxSize>(mat, grid)) {
+        mat.template solve<N*N>(std::ref(g));
+    }
+    deselect_all_rows(mat);
+    return count;
+}
 
-    dance_result result;
-    result.count = 1;
-    result.short_circuit = false;
-    return result;
+template<int BoxSize>
+int find_sudoku_solutions(const int grid[][BoxSize*BoxSize], int (*solutions)[BoxSize*BoxSize][BoxSize*BoxSize], int limit)
+{
+    int n = 0;
+    return enumerate_sudoku_solutions<BoxSize>(grid, limit, [&](const int (*solution)[BoxSize*BoxSize]) {
+        memcpy(solutions[n++], solution, sizeof solutions[0]);
+        return false;
+    });
 }
 
-void print_unique_sudoku_solution(const int grid[9][9])
+template<int BoxSize>
+void print_unique_sudoku_solution(const int grid[][BoxSize*BoxSize])
 {
-    solve_sudoku_with_callback(grid, print_unique_sudoku_result);
+    enumerate_sudoku_solutions<BoxSize>(grid, INT_MAX, [](const int (*solution)[BoxSize*BoxSize]) {
+        printf("-----\n");
+        print_sudoku_grid<BoxSize>(solution);
+        return false;
+    });
 }
+
+template int count_sudoku_solutions<2>(const int grid[][4]);
+template int count_sudoku_solutions<4>(const int grid[][16]);
+template int count_sudoku_solutions<5>(const int grid[][25]);
+template void count_sudoku_solutions_batch<2>(const int (*grids)[4][4], size_t n, int *counts, int limit);
+template void count_sudoku_solutions_batch<4>(const int (*grids)[16][16], size_t n, int *counts, int limit);
+template void count_sudoku_solutions_batch<5>(const int (*grids)[25][25], size_t n, int *counts, int limit);
+
+#define INSTANTIATE_SUDOKU_FUNCTIONS(BoxSize) \
+    template int count_sudoku_solutions_in_parallel<BoxSize>(const int grid[][BoxSize*BoxSize], int nthreads); \
+    template void print_sudoku_grid<BoxSize>(const int grid[][BoxSize*BoxSize]); \
+    template void print_unique_sudoku_solution<BoxSize>(const int grid[][BoxSize*BoxSize]); \
+    template int enumerate_sudoku_solutions<BoxSize>(const int grid[][BoxSize*BoxSize], int limit, \
+        const std::function<bool(const int (*)[BoxSize*BoxSize])>& f); \
+    template int find_sudoku_solutions<BoxSize>(const int grid[][BoxSize*BoxSize], \
+        int (*solutions)[BoxSize*BoxSize][BoxSize*BoxSize], int limit);
+
+INSTANTIATE_SUDOKU_FUNCTIONS(2)
+INSTANTIATE_SUDOKU_FUNCTIONS(3)
+INSTANTIATE_SUDOKU_FUNCTIONS(4)
+INSTANTIATE_SUDOKU_FUNCTIONS(5)
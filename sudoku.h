@@ -1,5 +1,96 @@
 #pragma once
 
-int count_sudoku_solutions(const int grid[9][9]);
-void print_sudoku_grid(const int grid[9][9]);
-void print_unique_sudoku_solution(const int grid[9][9]);
+#include <functional>
+#include <stddef.h>
+
+// The layout of an N-by-N Sudoku with BoxSize-by-BoxSize boxes,
+// where N = BoxSize*BoxSize. Cells are numbered 0..num_cells-1 in
+// reading order; values run from 1 to N.
+template<int BoxSize>
+struct SudokuShape {
+    static constexpr int N = BoxSize * BoxSize;
+    static constexpr int num_cells = N * N;
+    // The cells sharing a row, column or box with any one cell.
+    static constexpr int num_peers = 2*(N-1) + (BoxSize-1)*(BoxSize-1);
+
+    // The exact-cover matrix has one column for each row-value,
+    // column-value, box-value and cell, in that order.
+    static constexpr int num_columns = 4 * num_cells;
+    static constexpr int num_rows = N * num_cells;
+
+    static constexpr int box_of(int row, int col) {
+        return (row / BoxSize) * BoxSize + (col / BoxSize);
+    }
+    static constexpr bool are_peers(int i, int j) {
+        return (i / N == j / N) || (i % N == j % N) ||
+               (box_of(i / N, i % N) == box_of(j / N, j % N));
+    }
+    static void get_constraint_columns(int row, int col, int value, int constraint[4]) {
+        constraint[0] = N*row + value-1;
+        constraint[1] = num_cells + N*col + value-1;
+        constraint[2] = 2*num_cells + N*box_of(row, col) + value-1;
+        constraint[3] = 3*num_cells + (N*row + col);
+    }
+};
+
+// Fills |mat|, a DanceMatrix or anything with the same interface, with
+// every candidate row of every cell, even the cells that will hold
+// clues; the caller selects the clues with select_row().
+template<int BoxSize, class Matrix>
+void build_full_sudoku_matrix(Matrix& mat)
+{
+    using Shape = SudokuShape<BoxSize>;
+    constexpr int N = Shape::N;
+    mat.init(Shape::num_columns);
+
+    int constraint[4];
+    for (int i = 0; i < Shape::num_cells; ++i) {
+        for (int value = N; value >= 1; --value) {
+            Shape::get_constraint_columns(i / N, i % N, value, constraint);
+            mat.addrow(4, constraint);
+        }
+    }
+    mat.nrows_ = Shape::num_rows;
+    // This matrix will be searched many times, so it's worth
+    // renumbering its nodes for locality.
+    mat.sort_nodes_by_column();
+}
+
+// These all work for any BoxSize from 2 to 5; the default is
+// ordinary 9x9 Sudoku, so that count_sudoku_solutions(grid) still
+// means what it always has. Larger grids take an explicit BoxSize,
+// e.g. count_sudoku_solutions<4>(grid16).
+template<int BoxSize = 3>
+int count_sudoku_solutions(const int grid[][BoxSize*BoxSize]);
+template<int BoxSize = 3>
+int count_sudoku_solutions_in_parallel(const int grid[][BoxSize*BoxSize], int nthreads);
+
+// Counts the solutions of each of the |n| grids into |counts|,
+// stopping at |limit| solutions per grid. This is for checking many
+// grids: rather than building a matrix for each grid, every thread
+// keeps one with all the candidates, and selects each grid's clues.
+template<int BoxSize = 3>
+void count_sudoku_solutions_batch(const int (*grids)[BoxSize*BoxSize][BoxSize*BoxSize],
+                                  size_t n, int *counts, int limit);
+
+// Finds up to |limit| solutions to |grid|, passing each one to |f|
+// as a completed grid. |f| returns true to stop early. Returns the
+// number of solutions passed to |f|.
+template<int BoxSize = 3>
+int enumerate_sudoku_solutions(const int grid[][BoxSize*BoxSize], int limit,
+                               const std::function<bool(const int (*)[BoxSize*BoxSize])>& f);
+
+// Like enumerate_sudoku_solutions(), but stores the solutions in
+// |solutions|, which must have room for |limit| grids.
+template<int BoxSize = 3>
+int find_sudoku_solutions(const int grid[][BoxSize*BoxSize],
+                          int (*solutions)[BoxSize*BoxSize][BoxSize*BoxSize], int limit);
+
+template<int BoxSize = 3>
+void print_sudoku_grid(const int grid[][BoxSize*BoxSize]);
+template<int BoxSize = 3>
+void print_unique_sudoku_solution(const int grid[][BoxSize*BoxSize]);
+
+// For 9x9, counting goes to the bitboard solver when it's enabled.
+template<> int count_sudoku_solutions<3>(const int grid[][9]);
+template<> void count_sudoku_solutions_batch<3>(const int (*grids)[9][9], size_t n, int *counts, int limit);
@@ -5,6 +5,7 @@
 #include <queue>
 #include <string>
 #include <thread>
+#include <vector>
 
 struct ProducerShutDownException {};
 struct ConsumerShutDownException {};
@@ -64,6 +65,29 @@ public:
         lk.unlock();
         return result;
     }
+    int pop_some(T *values, int max) {
+        std::unique_lock<std::mutex> lk(mtx_);
+        while (q_.empty()) {
+            if (shutdown_ || shutdown_when_empty_) {
+                consumer_has_been_notified_ = true;
+                wait_cv_.notify_all();
+                throw ConsumerShutDownException();
+            }
+            cv_.wait(lk);
+        }
+        if (shutdown_) {
+            consumer_has_been_notified_ = true;
+            wait_cv_.notify_all();
+            throw ConsumerShutDownException();
+        }
+        int n = 0;
+        while (n < max && !q_.empty()) {
+            values[n++] = std::move(q_.front());
+            q_.pop();
+        }
+        lk.unlock();
+        return n;
+    }
     bool try_pop(T& value) {
         std::unique_lock<std::mutex> lk(mtx_);
         if (q_.empty()) {
@@ -102,7 +126,7 @@ public:
     }
 };
 
-template<class State, class Task, int NumThreads, class CRTP>
+template<class State, class Task, int NumThreads, class CRTP, int BatchSize = 1>
 class RoundRobinPool {
     std::thread workers_[NumThreads];
     ConcurrentQueue<Task> queues_[NumThreads];
@@ -112,6 +136,15 @@ class RoundRobinPool {
     CRTP& as_crtp() { return static_cast<CRTP&>(*this); }
 
 public:
+    // Each worker pops up to BatchSize tasks at a time and hands them
+    // all to process_batch(). The CRTP class may provide its own
+    // process_batch(); by default, we just process() them one by one.
+    void process_batch(State& state, Task *tasks, int n) {
+        for (int i=0; i < n; ++i) {
+            as_crtp().process(state, std::move(tasks[i]));
+        }
+    }
+
     template<class F>
     void for_each_state(const F& f) {
         for (int i=0; i < NumThreads; ++i) {
@@ -164,10 +197,11 @@ public:
     void start_threads() {
         for (int i=0; i < NumThreads; ++i) {
             workers_[i] = std::thread([this, i]() {
+                std::vector<Task> tasks(BatchSize);
                 while (true) {
                     try {
-                        auto task = queues_[i].pop();
-                        as_crtp().process(states_[i], std::move(task));
+                        int n = queues_[i].pop_some(tasks.data(), BatchSize);
+                        as_crtp().process_batch(states_[i], tasks.data(), n);
                     } catch (const ConsumerShutDownException&) {
                         queues_[i].shutdown_from_consumer_side();
                         return;